@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "admit.h"
+
+struct admit_limit admit_src_limit, admit_dev_limit;
+struct admit_stats admit_stats;
+
+static struct admit_bucket src_table[ADMIT_SRC_SLOTS];
+static struct admit_bucket *dev_table;
+static int dev_count;
+
+/*
+ * now_ms()
+ * Milliseconds on the monotonic clock.  Wraps every ~49 days, which the
+ * unsigned subtraction in refill() tolerates.
+ */
+static uint32_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+} /* now_ms */
+
+
+/*
+ * refill()
+ * Credit the bucket for the time elapsed since it was last touched, then
+ * try to take one packet from it.  Return non-zero if the packet may pass.
+ */
+static int refill(struct admit_bucket *b, const struct admit_limit *limit,
+                  uint32_t now)
+{
+  uint32_t cap = limit->burst * 1000;
+  uint32_t elapsed = now - b->last;
+
+  /* A bucket idle for longer than it takes to fill is simply full; this
+   * also keeps elapsed * rate from overflowing. */
+  if (elapsed >= cap / limit->rate + 1) {
+    b->tokens = cap;
+  }
+  else {
+    b->tokens += elapsed * limit->rate;
+    if (b->tokens > cap) b->tokens = cap;
+  }
+  b->last = now;
+
+  if (b->tokens < 1000) {
+    b->drops++;
+    return 0;
+  }
+  b->tokens -= 1000;
+  return 1;
+} /* refill */
+
+
+/*
+ * admit_parse_limit()
+ * Parse a "RATE[/BURST]" string into *limit.  The burst defaults to one
+ * second's worth of packets.  Return non-zero on a malformed string.
+ */
+int admit_parse_limit(char *str, struct admit_limit *limit)
+{
+  char *end;
+  long rate, burst;
+
+  errno = 0;
+  rate = strtol(str, &end, 0);
+  if (errno || rate < 0 || rate > 1000000 || end == str) {
+    return 1;
+  }
+  if (*end == '/') {
+    str = end + 1;
+    burst = strtol(str, &end, 0);
+    if (errno || burst <= 0 || burst > 1000000 || end == str) {
+      return 1;
+    }
+  }
+  else {
+    burst = rate;
+  }
+  if (*end != '\0') {
+    return 1;
+  }
+
+  limit->rate = rate;
+  limit->burst = burst > 0 ? burst : 1;
+  return 0;
+} /* admit_parse_limit */
+
+
+/*
+ * admit_init()
+ * Allocate the per-device buckets.  Exit if anything goes wrong.
+ */
+void admit_init(int device_count)
+{
+  dev_table = (struct admit_bucket *) calloc(device_count,
+                                             sizeof(struct admit_bucket));
+  if (dev_table == NULL) {
+    perror("admit_init: calloc");
+    exit(1);
+  }
+  dev_count = device_count;
+} /* admit_init */
+
+
+/*
+ * admit_packet()
+ * Decide whether a datagram from src_addr (network order), sent by the
+ * registered device with index device (or -1 if unknown), may be processed.
+ * Return non-zero to accept it.
+ *
+ * The source table is direct-mapped.  A colliding address takes the slot
+ * over only once the incumbent's bucket has refilled completely; until
+ * then the two share a bucket, which errs on the side of dropping.
+ */
+int admit_packet(uint32_t src_addr, int device)
+{
+  uint32_t now;
+  struct admit_bucket *b;
+
+  if (admit_src_limit.rate == 0 && admit_dev_limit.rate == 0) {
+    admit_stats.passed++;
+    return 1;
+  }
+
+  now = now_ms();
+
+  if (admit_src_limit.rate != 0) {
+    b = &src_table[(src_addr * 2654435761u) >> 20 & (ADMIT_SRC_SLOTS - 1)];
+    if (b->key != src_addr) {
+      uint32_t cap = admit_src_limit.burst * 1000;
+
+      if (b->key == 0 ||
+          now - b->last >= (cap - b->tokens) / admit_src_limit.rate + 1) {
+        b->key = src_addr;
+        b->tokens = cap;
+        b->last = now;
+        b->drops = 0;
+      }
+    }
+    if (!refill(b, &admit_src_limit, now)) {
+      admit_stats.src_drops++;
+      return 0;
+    }
+  }
+
+  if (admit_dev_limit.rate != 0 && device >= 0 && device < dev_count) {
+    if (!refill(&dev_table[device], &admit_dev_limit, now)) {
+      admit_stats.dev_drops++;
+      return 0;
+    }
+  }
+
+  admit_stats.passed++;
+  return 1;
+} /* admit_packet */
+
+
+/*
+ * admit_device_drops()
+ * Number of packets dropped so far by the given device's bucket.
+ */
+uint32_t admit_device_drops(int device)
+{
+  if (dev_table == NULL || device < 0 || device >= dev_count) {
+    return 0;
+  }
+  return dev_table[device].drops;
+} /* admit_device_drops */
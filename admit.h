@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+/* Token-bucket admission control for the UDP ingest path.  Buckets are
+ * refilled lazily on each packet, so the cost is O(1) per datagram. */
+
+#define ADMIT_SRC_SLOTS 4096   /* must be a power of two */
+
+struct admit_bucket {
+  uint32_t key;      /* source address (network order), 0 if slot unused */
+  uint32_t last;     /* last refill, ms on the monotonic clock */
+  uint32_t tokens;   /* in thousandths of a packet */
+  uint32_t drops;
+};
+
+struct admit_limit {
+  uint32_t rate;     /* packets per second; 0 disables the limit */
+  uint32_t burst;    /* packets */
+};
+
+struct admit_stats {
+  uint64_t passed;
+  uint64_t src_drops;
+  uint64_t dev_drops;
+};
+
+extern struct admit_limit admit_src_limit, admit_dev_limit;
+extern struct admit_stats admit_stats;
+
+extern int admit_parse_limit(char *str, struct admit_limit *limit);
+extern void admit_init(int device_count);
+extern int admit_packet(uint32_t src_addr, int device);
+extern uint32_t admit_device_drops(int device);
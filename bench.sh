@@ -0,0 +1,134 @@
+#!/bin/sh
+#
+# Benchmarks of a udptunnel on this host, driven by udpload (build both
+# with "make check" first).  Run from the build directory:
+#
+#   sh bench.sh flush [SECS]
+#   sh bench.sh lowlat [SECS]
+#   sh bench.sh stripes [SECS]
+#
+# For each of several --flush-bytes/--flush-records/--flush-usec settings
+# (flush), or with and without --low-latency (lowlat), and each offered
+# load, prints the records per second delivered as WIR output and the
+# receive-to-send latency (LAT_TOTAL of --latency-stats): a throughput vs
+# p99 curve.  LOW_LATENCY_CPU (default: the last one) is the CPU that
+# --low-latency pins to.  udptunnel's stderr is kept in
+# bench-udptunnel.log.
+#
+# stripes runs a --tunnel client and server pair for each --stripes=K in
+# STRIPES, with the TCP leg between them losing LOSS of its packets, and
+# prints the one-way latency and loss that udpload sees across it.  Run
+# as root where the netem qdisc is available, the loss is netem's (with
+# DELAY each way, on the tunnel's TCP port only); otherwise it is
+# emulated by "udpload proxy" stalling the connection STALL_MS
+# milliseconds on LOSS of its reads.
+
+UDP_PORT=${UDP_PORT:-17600}
+TCP_PORT=${TCP_PORT:-17601}
+SECS=${2:-5}
+RATES=${RATES:-"1000 10000 30000 60000"}
+STRIPES=${STRIPES:-"1 2 4 8"}
+LOSS=${LOSS:-1}
+DELAY=${DELAY:-5ms}
+STALL_MS=${STALL_MS:-20}
+TUNNEL_RATE=${TUNNEL_RATE:-5000}
+LOW_LATENCY_CPU=${LOW_LATENCY_CPU:-`expr \`getconf _NPROCESSORS_ONLN\` - 1`}
+LOG=bench-udptunnel.log
+
+# The first four registered devices.
+IMEIS=`grep -o '{ *[0-9]\{15\}' ${srcdir:-.}/wirvars.h | tr -d '{ ' | head -4`
+
+# run OPTIONS RATE
+# Relay RATE packets a second through a udptunnel started with OPTIONS,
+# and print one result line.
+run() {
+  ./udptunnel -s $TCP_PORT --latency-stats $1 127.0.0.1/$UDP_PORT 2>$LOG &
+  pid=$!
+  sleep 0.3
+  load=`./udpload wir -u $UDP_PORT -t $TCP_PORT -r $2 -d $SECS -k $pid $IMEIS`
+  wait $pid 2>/dev/null
+  got=`echo "$load" | sed -n 's/.*received [0-9]* records (\([0-9]*\)\/s).*/\1/p'`
+  lat=`grep -a '^Latency total' $LOG | tail -1 | \
+       sed 's/.*p50<\([^ ]*\) p90<[^ ]* p99<\([^ ]*\) max=\([^ ]*\)/\1 \2 \3/'`
+  printf "%-56s %7s %9s  %s\n" "${1:-(defaults)}" $2 "$got" "$lat"
+}
+
+header() {
+  printf "%-56s %7s %9s  %s\n" "options" "offered" "records/s" \
+         "LAT_TOTAL p50 p99 max"
+}
+
+flush() {
+  header
+  for opts in "" "--flush-records=0 --flush-usec=100" \
+              "--flush-records=16 --flush-usec=1000" \
+              "--flush-records=64 --flush-usec=5000" \
+              "--flush-records=0 --flush-bytes=16384 --flush-usec=20000"; do
+    for rate in $RATES; do
+      run "$opts" $rate
+    done
+  done
+}
+
+lowlat() {
+  header
+  for opts in "" "--low-latency=$LOW_LATENCY_CPU"; do
+    for rate in $RATES; do
+      run "$opts" $rate
+    done
+  done
+}
+
+# netem_on
+# Make the TCP leg on TCP_PORT lossy with netem; fail if we cannot.
+netem_on() {
+  tc qdisc add dev lo root handle 1: prio 2>/dev/null &&
+  tc qdisc add dev lo parent 1:3 handle 30: \
+     netem delay $DELAY loss $LOSS% 2>/dev/null &&
+  tc filter add dev lo parent 1:0 protocol ip u32 \
+     match ip dport $TCP_PORT 0xffff flowid 1:3 &&
+  tc filter add dev lo parent 1:0 protocol ip u32 \
+     match ip sport $TCP_PORT 0xffff flowid 1:3 ||
+  { tc qdisc del dev lo root 2>/dev/null; false; }
+}
+
+stripes() {
+  if netem_on; then
+    how="netem delay $DELAY loss $LOSS%"
+    proxy_port=$TCP_PORT
+  else
+    how="udpload proxy: ${LOSS}% of reads stall ${STALL_MS} ms (no netem)"
+    proxy_port=`expr $TCP_PORT + 2`
+  fi
+  echo "$TUNNEL_RATE datagrams/s over 64 flows; $how"
+  for k in $STRIPES; do
+    ./udptunnel -s $TCP_PORT --tunnel --stripes=$k \
+      127.0.0.1/`expr $UDP_PORT + 2` 2>$LOG &
+    server=$!
+    if [ $proxy_port != $TCP_PORT ]; then
+      ./udpload proxy -l $proxy_port -t $TCP_PORT -p `expr $LOSS \* 10` \
+        -w $STALL_MS &
+      proxy=$!
+    fi
+    sleep 0.3
+    ./udptunnel -c 127.0.0.1/$proxy_port --tunnel --stripes=$k \
+      127.0.0.1/$UDP_PORT 2>>$LOG &
+    client=$!
+    sleep 0.5
+    printf "K=%-2s " $k
+    ./udpload tunnel -u $UDP_PORT -o `expr $UDP_PORT + 2` -r $TUNNEL_RATE \
+      -d $SECS -f 64
+    kill $client $server $proxy 2>/dev/null
+    wait 2>/dev/null
+  done
+  if [ $proxy_port = $TCP_PORT ]; then
+    tc qdisc del dev lo root
+  fi
+}
+
+case "$1" in
+flush) flush ;;
+lowlat) lowlat ;;
+stripes) stripes ;;
+*) echo "Usage: $0 flush|lowlat|stripes [SECS]" >&2; exit 2 ;;
+esac
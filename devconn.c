@@ -0,0 +1,667 @@
+#define _GNU_SOURCE   /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "devconn.h"
+#include "handoff.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define DEVCONN_EVENTS 256         /* events handled per devconn_poll() */
+#define DEVCONN_ACCEPTS 64         /* connections accepted per devconn_poll() */
+#define DEVCONN_INITIAL_BUF 256
+#define DEVCONN_MAX_FRAME 65536    /* larger frames close the connection */
+#define DEVCONN_MAX_IMEI 32
+#define DEVCONN_HANDSHAKE_TIMEOUT 30  /* seconds to send the IMEI */
+#define DEVCONN_HANDOFF_MSG (HANDOFF_MAX_FDS * \
+                             sizeof(struct devconn_snapshot) + \
+                             DEVCONN_MAX_FRAME + sizeof(uint64_t))
+
+struct devconn {
+  int fd;
+  int device;             /* device index, -1 until the IMEI is accepted */
+  uint64_t imei;
+  uint32_t peer;          /* network order */
+  unsigned char *buf;
+  int len, size;          /* bytes buffered, bytes allocated */
+  enum {reading_imei, reading_frame} state;
+  time_t accepted_at, active_at;
+  struct devconn *prev, *next;    /* conns, most recently active first */
+  struct devconn *pprev, *pnext;  /* pending, while reading the IMEI */
+};
+
+/* A connection as passed to a successor by devconn_handoff(). */
+struct devconn_snapshot {
+  uint64_t imei;          /* mapped afresh, in case the registry changed */
+  uint32_t peer;
+  int32_t state;
+  int32_t len;            /* buffered bytes, which follow the snapshots */
+};
+
+static int epoll_fd = -1;
+static int listen_sock = -1;
+static devconn_imei_fn imei_cb;
+static devconn_frame_fn frame_cb;
+static struct devconn *conns;    /* every open connection */
+static struct devconn *conns_tail;
+static struct devconn *pending;  /* connections yet to send their IMEI */
+static struct devconn *pending_tail;
+
+static unsigned long conn_count, conn_total, frames_total, conn_refused;
+static unsigned long crc_errors, conn_reaped;
+
+/*
+ * now_sec()
+ * Seconds on the monotonic clock.
+ */
+static time_t now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+} /* now_sec */
+
+
+/*
+ * crc16()
+ * The CRC-16/IBM of len bytes at p, as Codec8 frames carry it.
+ */
+static uint16_t crc16(const unsigned char *p, int len)
+{
+  uint16_t crc = 0;
+  int i;
+
+  while (len-- > 0) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+} /* crc16 */
+
+
+/*
+ * setup_epoll()
+ * Create the epoll set and note the callbacks.  Exit if anything goes
+ * wrong.
+ */
+static void setup_epoll(devconn_imei_fn imei_fn, devconn_frame_fn frame_fn)
+{
+  struct rlimit rl;
+
+  imei_cb = imei_fn;
+  frame_cb = frame_fn;
+
+  /* Every device holds a descriptor; allow as many as we are permitted. */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("devconn: epoll_create1");
+    exit(1);
+  }
+} /* setup_epoll */
+
+
+/*
+ * watch()
+ * Add a descriptor to the epoll set; c is NULL for the listener.  Exit if
+ * it fails.
+ */
+static void watch(int fd, struct devconn *c)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("devconn: epoll_ctl");
+    exit(1);
+  }
+} /* watch */
+
+
+/*
+ * link_conn()
+ * Add a connection to the list of open ones, and to the pending list if
+ * it has yet to send its IMEI.
+ */
+static void link_conn(struct devconn *c)
+{
+  c->accepted_at = c->active_at = now_sec();
+  c->prev = NULL;
+  c->next = conns;
+  if (conns) conns->prev = c;
+  else conns_tail = c;
+  conns = c;
+  conn_count++;
+
+  if (c->state == reading_imei) {
+    c->pnext = NULL;
+    c->pprev = pending_tail;
+    if (pending_tail) pending_tail->pnext = c;
+    else pending = c;
+    pending_tail = c;
+  }
+} /* link_conn */
+
+
+/*
+ * unlink_pending()
+ * Take a connection off the pending list.
+ */
+static void unlink_pending(struct devconn *c)
+{
+  if (c->pprev) c->pprev->pnext = c->pnext;
+  else pending = c->pnext;
+  if (c->pnext) c->pnext->pprev = c->pprev;
+  else pending_tail = c->pprev;
+} /* unlink_pending */
+
+
+/*
+ * unlink_conn()
+ * Take a connection off the list of open ones.
+ */
+static void unlink_conn(struct devconn *c)
+{
+  if (c->prev) c->prev->next = c->next;
+  else conns = c->next;
+  if (c->next) c->next->prev = c->prev;
+  else conns_tail = c->prev;
+} /* unlink_conn */
+
+
+/*
+ * touch_conn()
+ * Note activity on a connection, moving it to the front of the list so
+ * that the list stays ordered for devconn_expire().
+ */
+static void touch_conn(struct devconn *c)
+{
+  c->active_at = now_sec();
+  if (conns != c) {
+    unlink_conn(c);
+    c->prev = NULL;
+    c->next = conns;
+    conns->prev = c;
+    conns = c;
+  }
+} /* touch_conn */
+
+
+/*
+ * devconn_init()
+ * Start listening for device connections on addr.  Exit if anything goes
+ * wrong.
+ */
+void devconn_init(const struct sockaddr_in *addr,
+                  devconn_imei_fn imei_fn, devconn_frame_fn frame_fn)
+{
+  int opt;
+
+  setup_epoll(imei_fn, frame_fn);
+
+  if ((listen_sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    perror("devconn_init: socket");
+    exit(1);
+  }
+
+  opt = 1;
+  if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
+                 (void *)&opt, sizeof(opt)) < 0) {
+    perror("devconn_init: setsockopt(SO_REUSEADDR)");
+    exit(1);
+  }
+
+  if (bind(listen_sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    perror("devconn_init: bind");
+    exit(1);
+  }
+
+  if (listen(listen_sock, SOMAXCONN) < 0) {
+    perror("devconn_init: listen");
+    exit(1);
+  }
+
+  watch(listen_sock, NULL);
+} /* devconn_init */
+
+
+/*
+ * devconn_fd()
+ * The epoll descriptor; readable when devconn_poll() has work to do.
+ */
+int devconn_fd(void)
+{
+  return epoll_fd;
+} /* devconn_fd */
+
+
+/*
+ * close_conn()
+ * Drop a device connection.
+ */
+static void close_conn(struct devconn *c)
+{
+  close(c->fd);    /* also removes it from the epoll set */
+  unlink_conn(c);
+  if (c->state == reading_imei) {
+    unlink_pending(c);
+  }
+  free(c->buf);
+  free(c);
+  conn_count--;
+} /* close_conn */
+
+
+/*
+ * accept_conns()
+ * Accept pending device connections.
+ */
+static void accept_conns(void)
+{
+  struct sockaddr_in peer;
+  socklen_t peerlen;
+  struct epoll_event ev;
+  struct devconn *c;
+  int fd, opt, i;
+
+  for (i = 0; i < DEVCONN_ACCEPTS; i++) {
+    peerlen = sizeof(peer);
+    if ((fd = accept4(listen_sock, (struct sockaddr *)&peer, &peerlen,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        perror("devconn: accept");
+      }
+      return;
+    }
+
+    opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&opt, sizeof(opt));
+
+    if ((c = (struct devconn *) calloc(1, sizeof(*c))) == NULL ||
+        (c->buf = malloc(DEVCONN_INITIAL_BUF)) == NULL) {
+      perror("devconn: malloc");
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->device = -1;
+    c->peer = peer.sin_addr.s_addr;
+    c->size = DEVCONN_INITIAL_BUF;
+    c->state = reading_imei;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("devconn: epoll_ctl");
+      free(c->buf);
+      free(c);
+      close(fd);
+      continue;
+    }
+    link_conn(c);
+    conn_total++;
+  }
+} /* accept_conns */
+
+
+/*
+ * reply()
+ * Send a short answer to a device.  The socket buffer is never anywhere
+ * near full of these, so a short write means the device is gone.
+ * Return non-zero on failure.
+ */
+static int reply(struct devconn *c, const void *data, int len)
+{
+  return send(c->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len;
+} /* reply */
+
+
+/*
+ * need_bytes()
+ * How many bytes the unit at the start of c->buf needs in total, given
+ * what is buffered so far, or -1 if it is malformed.
+ */
+static int need_bytes(struct devconn *c)
+{
+  uint32_t len;
+
+  if (c->state == reading_imei) {
+    if (c->len < 2) return 2;
+    len = (c->buf[0] << 8) | c->buf[1];
+    if (len == 0 || len > DEVCONN_MAX_IMEI) return -1;
+    return 2 + len;
+  }
+
+  if (c->len < 8) return 8;
+  if (c->buf[0] || c->buf[1] || c->buf[2] || c->buf[3]) return -1;
+  len = ((uint32_t)c->buf[4] << 24) | (c->buf[5] << 16) |
+        (c->buf[6] << 8) | c->buf[7];
+  if (len > DEVCONN_MAX_FRAME - 12) return -1;
+  return len + 12;
+} /* need_bytes */
+
+
+/*
+ * handle_unit()
+ * A complete IMEI or frame of n bytes is at the start of c->buf.  Return
+ * DEVCONN_CLOSE or DEVCONN_FATAL on failure, otherwise 0.
+ */
+static int handle_unit(struct devconn *c, int n)
+{
+  unsigned char answer[4];
+  uint64_t imei = 0;
+  uint32_t crc;
+  int i, records;
+
+  if (c->state == reading_imei) {
+    for (i = 2; i < n; i++) {
+      if (c->buf[i] < '0' || c->buf[i] > '9') return DEVCONN_CLOSE;
+      imei = imei * 10 + (c->buf[i] - '0');
+    }
+    c->imei = imei;
+    c->device = imei_cb(imei);
+    answer[0] = c->device >= 0;
+    if (reply(c, answer, 1) || c->device < 0) {
+      conn_refused += c->device < 0;
+      return DEVCONN_CLOSE;
+    }
+    unlink_pending(c);
+    c->state = reading_frame;
+    return 0;
+  }
+
+  frames_total++;
+  crc = ((uint32_t)c->buf[n - 4] << 24) | (c->buf[n - 3] << 16) |
+        (c->buf[n - 2] << 8) | c->buf[n - 1];
+  if (crc != crc16(c->buf + 8, n - 12)) {
+    /* Acknowledging nothing makes the device send the frame again. */
+    crc_errors++;
+    records = 0;
+  }
+  else if ((records = frame_cb(c->buf, n, c->device, c->peer)) < 0) {
+    return records;
+  }
+  answer[0] = records >> 24;
+  answer[1] = records >> 16;
+  answer[2] = records >> 8;
+  answer[3] = records;
+  return reply(c, answer, 4) ? DEVCONN_CLOSE : 0;
+} /* handle_unit */
+
+
+/*
+ * read_conn()
+ * A device connection is readable.  Read what is there and handle every
+ * complete unit.  Return DEVCONN_CLOSE or DEVCONN_FATAL on failure,
+ * otherwise 0.
+ */
+static int read_conn(struct devconn *c)
+{
+  int n, need, err;
+  unsigned char *grown;
+
+  if ((n = read(c->fd, c->buf + c->len, c->size - c->len)) <= 0) {
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    return DEVCONN_CLOSE;
+  }
+  c->len += n;
+  touch_conn(c);
+
+  for (;;) {
+    if ((need = need_bytes(c)) < 0) return DEVCONN_CLOSE;
+    if (c->len < need) {
+      if (need > c->size) {
+        /* Make room for the whole unit before the next read. */
+        if ((grown = realloc(c->buf, need)) == NULL) return DEVCONN_CLOSE;
+        c->buf = grown;
+        c->size = need;
+      }
+      return 0;
+    }
+    if ((err = handle_unit(c, need)) != 0) return err;
+    memmove(c->buf, c->buf + need, c->len - need);
+    c->len -= need;
+  }
+} /* read_conn */
+
+
+/*
+ * devconn_poll()
+ * Handle whatever device connections are ready, without blocking.  If we
+ * need to bail out, return non-zero.
+ */
+int devconn_poll(void)
+{
+  struct epoll_event events[DEVCONN_EVENTS];
+  struct devconn *c;
+  int n, i, err;
+
+  if ((n = epoll_wait(epoll_fd, events, DEVCONN_EVENTS, 0)) < 0) {
+    if (errno == EINTR) return 0;
+    perror("devconn_poll: epoll_wait");
+    return 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    if ((c = events[i].data.ptr) == NULL) {
+      accept_conns();
+      continue;
+    }
+    /* Errors and hangups show up as the read failing or hitting EOF. */
+    err = read_conn(c);
+    if (err == DEVCONN_FATAL) return 1;
+    if (err != 0) {
+      close_conn(c);
+    }
+  }
+  return 0;
+} /* devconn_poll */
+
+
+/*
+ * devconn_expire()
+ * Close connections that have not sent their IMEI within
+ * DEVCONN_HANDSHAKE_TIMEOUT seconds of being accepted and, if idle is not
+ * 0, any that have been silent for idle seconds.  Both lists are kept
+ * oldest last or first, so only the connections closed are looked at.
+ */
+void devconn_expire(int idle)
+{
+  time_t now = now_sec();
+  struct devconn *c;
+
+  while ((c = pending) != NULL &&
+         now - c->accepted_at >= DEVCONN_HANDSHAKE_TIMEOUT) {
+    close_conn(c);
+    conn_reaped++;
+  }
+
+  if (idle == 0) return;
+  while ((c = conns_tail) != NULL && now - c->active_at >= idle) {
+    close_conn(c);
+    conn_reaped++;
+  }
+} /* devconn_expire */
+
+
+/*
+ * devconn_handoff()
+ * Pass the listener and every open connection, with whatever it has
+ * buffered, to a successor on sock.  Each message carries up to
+ * HANDOFF_MAX_FDS connections: one snapshot per descriptor, followed by
+ * their buffered bytes.  Return non-zero on failure; we keep our own
+ * copies, so on failure we simply carry on.
+ */
+int devconn_handoff(int sock)
+{
+  static uint64_t msg[DEVCONN_HANDOFF_MSG / sizeof(uint64_t)];
+  struct devconn_snapshot *snap = (struct devconn_snapshot *) msg;
+  struct devconn *c = conns;
+  unsigned char *data;
+  int fds[HANDOFF_MAX_FDS];
+  uint64_t total = conn_count;
+  int nfds, datalen;
+
+  if (handoff_send(sock, &total, sizeof(total), &listen_sock, 1)) return 1;
+
+  while (c != NULL) {
+    /* Snapshots first, so the buffered bytes go after the last of them. */
+    struct devconn *first = c;
+
+    for (nfds = datalen = 0; c != NULL && nfds < HANDOFF_MAX_FDS &&
+         datalen + c->len <= DEVCONN_MAX_FRAME; c = c->next) {
+      snap[nfds].imei = c->imei;
+      snap[nfds].peer = c->peer;
+      snap[nfds].state = c->state;
+      snap[nfds].len = c->len;
+      fds[nfds++] = c->fd;
+      datalen += c->len;
+    }
+    data = (unsigned char *) &snap[nfds];
+    for (; first != c; first = first->next) {
+      memcpy(data, first->buf, first->len);
+      data += first->len;
+    }
+    if (handoff_send(sock, msg, data - (unsigned char *) msg, fds, nfds)) {
+      return 1;
+    }
+  }
+  return 0;
+} /* devconn_handoff */
+
+
+/*
+ * devconn_takeover()
+ * The devconn_init() of a successor: receive the listener and the open
+ * connections from our predecessor on sock.  Exit if anything goes wrong.
+ */
+void devconn_takeover(int sock, devconn_imei_fn imei_fn,
+                      devconn_frame_fn frame_fn)
+{
+  static uint64_t msg[DEVCONN_HANDOFF_MSG / sizeof(uint64_t)];
+  struct devconn_snapshot *snap = (struct devconn_snapshot *) msg;
+  struct devconn *c;
+  unsigned char *data, *end;
+  int fds[HANDOFF_MAX_FDS];
+  uint64_t total, received = 0;
+  int nfds, i;
+  ssize_t n;
+
+  setup_epoll(imei_fn, frame_fn);
+
+  nfds = 1;
+  if (handoff_recv(sock, &total, sizeof(total), &listen_sock, &nfds) !=
+      sizeof(total) || nfds != 1) {
+    fprintf(stderr, "devconn_takeover: no listener from predecessor\n");
+    exit(1);
+  }
+  watch(listen_sock, NULL);
+
+  while (received < total) {
+    nfds = HANDOFF_MAX_FDS;
+    if ((n = handoff_recv(sock, msg, sizeof(msg), fds, &nfds)) < 0 ||
+        nfds == 0 || n < nfds * (ssize_t) sizeof(*snap)) {
+      fprintf(stderr, "devconn_takeover: connections cut short\n");
+      exit(1);
+    }
+    data = (unsigned char *) &snap[nfds];
+    end = (unsigned char *) msg + n;
+
+    for (i = 0; i < nfds; i++) {
+      if (snap[i].len < 0 || snap[i].len > end - data ||
+          (c = (struct devconn *) calloc(1, sizeof(*c))) == NULL ||
+          (c->buf = malloc(snap[i].len + DEVCONN_INITIAL_BUF)) == NULL) {
+        fprintf(stderr, "devconn_takeover: cannot adopt connection\n");
+        exit(1);
+      }
+      c->fd = fds[i];
+      c->imei = snap[i].imei;
+      c->device = -1;
+      c->peer = snap[i].peer;
+      c->state = reading_imei;
+      c->len = snap[i].len;
+      c->size = c->len + DEVCONN_INITIAL_BUF;
+      memcpy(c->buf, data, c->len);
+      data += c->len;
+
+      if (snap[i].state == reading_frame) {
+        c->state = reading_frame;
+        if ((c->device = imei_cb(c->imei)) < 0) {
+          /* No longer registered. */
+          close(c->fd);
+          free(c->buf);
+          free(c);
+          continue;
+        }
+      }
+      watch(c->fd, c);
+      link_conn(c);
+    }
+    received += nfds;
+  }
+  conn_total = conn_count;
+} /* devconn_takeover */
+
+
+/*
+ * devconn_stats()
+ * Print the device listener's counters.
+ */
+void devconn_stats(FILE *out)
+{
+  if (epoll_fd == -1) return;
+  fprintf(out, "Device connections: %lu open, %lu accepted, %lu refused, "
+          "%lu timed out; %lu frames, %lu with bad CRC\n", conn_count,
+          conn_total, conn_refused, conn_reaped, frames_total, crc_errors);
+} /* devconn_stats */
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+void devconn_init(const struct sockaddr_in *addr,
+                  devconn_imei_fn imei_fn, devconn_frame_fn frame_fn)
+{
+  fprintf(stderr, "The TCP device listener is not supported on this "
+          "platform\n");
+  exit(2);
+} /* devconn_init */
+
+void devconn_takeover(int sock, devconn_imei_fn imei_fn,
+                      devconn_frame_fn frame_fn)
+{
+  devconn_init(NULL, imei_fn, frame_fn);
+} /* devconn_takeover */
+
+int devconn_fd(void) { return -1; }
+int devconn_handoff(int sock) { return 0; }
+int devconn_poll(void) { return 0; }
+void devconn_expire(int idle) { }
+void devconn_stats(FILE *out) { }
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Listener for devices that deliver Codec8 over TCP (Teltonika's TCP
+ * mode).  A device first sends its IMEI (a 16-bit length and ASCII
+ * digits) and is answered 0x01 if accepted or 0x00 if not.  It then sends
+ * frames of four zero bytes, a 32-bit data length, the data and a 32-bit
+ * CRC, each answered with the 32-bit count of records accepted (0 if the
+ * CRC is wrong, for the device to send the frame again).  A device that
+ * does not send its IMEI within DEVCONN_HANDSHAKE_TIMEOUT seconds is
+ * dropped, as is, optionally, one that stays silent for too long.
+ *
+ * Connections are kept in an epoll set; devconn_fd() is readable whenever
+ * devconn_poll() has work to do. */
+
+/* Map an IMEI to a device index, or return -1 to refuse the device. */
+typedef int (*devconn_imei_fn)(uint64_t imei);
+
+/* Handle a complete frame from the given device and peer address
+ * (network order).  Return the number of records to acknowledge,
+ * DEVCONN_CLOSE to drop the connection, or DEVCONN_FATAL to bail out. */
+typedef int (*devconn_frame_fn)(unsigned char *frame, int len, int device,
+                                uint32_t peer);
+
+#define DEVCONN_CLOSE (-1)
+#define DEVCONN_FATAL (-2)
+
+extern void devconn_init(const struct sockaddr_in *addr,
+                         devconn_imei_fn imei_fn, devconn_frame_fn frame_fn);
+extern void devconn_takeover(int sock, devconn_imei_fn imei_fn,
+                             devconn_frame_fn frame_fn);
+extern int devconn_fd(void);
+extern int devconn_poll(void);
+extern void devconn_expire(int idle);
+extern int devconn_handoff(int sock);
+extern void devconn_stats(FILE *out);
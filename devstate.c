@@ -0,0 +1,229 @@
+#define _GNU_SOURCE   /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "devstate.h"
+
+#define DEVSTATE_LINE 160          /* one formatted answer line */
+#define DEVSTATE_TIMEOUT 2         /* seconds a client has to ask */
+
+struct devstate_slot {
+  uint32_t seq;                    /* odd while being written */
+  struct devstate s;
+} __attribute__((aligned(64)));
+
+static struct devstate_slot *slots;
+static int slot_count;
+static int listen_sock = -1;
+
+/*
+ * read_slot()
+ * Copy a consistent snapshot of slot into *s, without taking any lock.
+ */
+static void read_slot(struct devstate_slot *slot, struct devstate *s)
+{
+  uint32_t seq;
+
+  for (;;) {
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      continue;   /* the writer is in there; it is never there for long */
+    }
+    memcpy(s, &slot->s, sizeof(*s));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+      return;
+    }
+  }
+} /* read_slot */
+
+
+/*
+ * answer()
+ * Send the client a line for s.  Return non-zero if the client has
+ * gone.
+ */
+static int answer(int sock, const struct devstate *s)
+{
+  char line[DEVSTATE_LINE];
+  int len;
+
+  len = snprintf(line, sizeof(line),
+                 "%" PRIu64 " %s %" PRIu64 " %" PRId32 " %" PRId32
+                 " %u %u %d %" PRIu64 "\n",
+                 s->imei, s->name != NULL ? s->name : "-", s->time_ms,
+                 s->latitude, s->longitude, s->speed, s->heading,
+                 s->temperature, s->seen_ms);
+  return send(sock, line, len, MSG_NOSIGNAL) != len;
+} /* answer */
+
+
+/*
+ * serve_query()
+ * Read one request from the client on sock and answer it.
+ */
+static void serve_query(int sock)
+{
+  char req[32];
+  struct devstate s;
+  struct timeval tv;
+  uint64_t imei;
+  char *end;
+  int len, i;
+
+  tv.tv_sec = DEVSTATE_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+  len = 0;
+  while (len < (int)sizeof(req) - 1 && memchr(req, '\n', len) == NULL) {
+    ssize_t n = recv(sock, req + len, sizeof(req) - 1 - len, 0);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    len += n;
+  }
+  req[len] = '\0';
+  req[strcspn(req, "\r\n")] = '\0';
+
+  if (strcmp(req, "all") == 0) {
+    for (i = 0; i < slot_count; i++) {
+      read_slot(&slots[i], &s);
+      if (s.imei != 0 && answer(sock, &s)) {
+        break;
+      }
+    }
+    return;
+  }
+
+  errno = 0;
+  imei = strtoull(req, &end, 10);
+  if (errno || end == req || *end != '\0') {
+    send(sock, "error: bad request\n", 19, MSG_NOSIGNAL);
+    return;
+  }
+  for (i = 0; i < slot_count; i++) {
+    read_slot(&slots[i], &s);
+    if (s.imei == imei) {
+      answer(sock, &s);
+      break;
+    }
+  }
+} /* serve_query */
+
+
+/*
+ * query_thread()
+ * Answer clients on the query socket, one at a time.
+ */
+static void *query_thread(void *arg)
+{
+  int sock;
+
+  for (;;) {
+    if ((sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("devstate: accept");
+        sleep(1);
+      }
+      continue;
+    }
+    serve_query(sock);
+    close(sock);
+  }
+  return NULL;
+} /* query_thread */
+
+
+/*
+ * devstate_init()
+ * Keep the last known state of count devices, and answer queries about
+ * them on a Unix socket at path, replacing any stale socket there.  Exit
+ * if anything goes wrong.
+ */
+void devstate_init(int count, const char *path)
+{
+  struct sockaddr_un addr;
+  pthread_t thread;
+  void *ptr;
+  int err;
+
+  if (posix_memalign(&ptr, sizeof(struct devstate_slot),
+                     count * sizeof(struct devstate_slot)) != 0) {
+    perror("devstate_init: posix_memalign");
+    exit(1);
+  }
+  memset(ptr, 0, count * sizeof(struct devstate_slot));
+  slots = ptr;
+  slot_count = count;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: state socket path too long\n", path);
+    exit(2);
+  }
+  strcpy(addr.sun_path, path);
+
+  if ((listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("devstate_init: socket");
+    exit(1);
+  }
+
+  unlink(path);
+  if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("devstate_init: bind");
+    exit(1);
+  }
+
+  if (listen(listen_sock, 16) < 0) {
+    perror("devstate_init: listen");
+    exit(1);
+  }
+
+  if ((err = pthread_create(&thread, NULL, query_thread, NULL)) != 0) {
+    fprintf(stderr, "devstate_init: pthread_create: %s\n", strerror(err));
+    exit(1);
+  }
+  pthread_detach(thread);
+} /* devstate_init */
+
+
+/*
+ * devstate_update()
+ * A record from the device has been decoded into *s.  Take its position
+ * if it is no older than the one we have (devices send stored records
+ * late, after a gap in coverage), and note that we have heard from the
+ * device either way.  Does nothing if devstate_init() was not called.
+ */
+void devstate_update(int device, const struct devstate *s)
+{
+  struct devstate_slot *slot;
+  uint32_t seq;
+
+  if (slots == NULL || device < 0 || device >= slot_count) {
+    return;
+  }
+  slot = &slots[device];
+
+  seq = slot->seq;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (slot->s.imei == 0 || s->time_ms >= slot->s.time_ms) {
+    slot->s = *s;
+  }
+  else {
+    slot->s.seen_ms = s->seen_ms;
+  }
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+} /* devstate_update */
@@ -0,0 +1,33 @@
+#include <stdint.h>
+
+/* Last known state of each registered device, kept up to date by the
+ * Codec8 decoder and served to local tools on a Unix stream socket.
+ *
+ * Each device has a cache line of its own, guarded by a sequence count:
+ * the decoder, the only writer, makes it odd while it updates the entry,
+ * and a reader copies the entry out and tries again if the count was odd
+ * or has moved on.  Queries are answered on a thread of their own, so
+ * they never hold up the decoder.
+ *
+ * A client connects, sends one line, either a device's IMEI or "all",
+ * and reads the answer until the connection is closed: a line
+ *
+ *   IMEI NAME GPS-TIME-MS LAT LON SPEED HEADING TEMPERATURE SEEN-MS
+ *
+ * for the device, or for every device heard from, with the position in
+ * 1e-7 degrees and the temperature in 1/100 degree C, as in wirbin.h.
+ * SEEN-MS is when we last had a record from the device, on the real-time
+ * clock.  A device not heard from gets no line. */
+
+struct devstate {
+  uint64_t imei;
+  const char *name;           /* must outlive the cache */
+  uint64_t time_ms;           /* GPS time of the newest record */
+  uint64_t seen_ms;
+  int32_t latitude, longitude;
+  uint16_t speed, heading;
+  int16_t temperature;
+};
+
+extern void devstate_init(int count, const char *path);
+extern void devstate_update(int device, const struct devstate *s);
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include <netinet/in.h>
+
+#include "flow.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define FLOW_EVENTS 256       /* events handled per flow_poll() */
+#define FLOW_BATCH 32         /* datagrams read per socket per flow_poll() */
+
+struct flow {
+  struct sockaddr_in addr;    /* our flows: the UDP peer */
+  int sock;                   /* the other side's flows: ours for it, or -1 */
+  time_t last_used;           /* 0 if the slot is free */
+  int next;                   /* our flows: hash chain, -1 at the end */
+  struct flow_table *table;
+};
+
+struct flow_table {
+  int max;
+  struct flow *ours;          /* by flow ID */
+  struct flow *theirs;        /* by flow ID */
+  int *hash;                  /* chains of our flows, by address */
+  unsigned int hash_mask;
+  int next_id;                /* where to look for a free ID next */
+  void *ctx;
+
+  int ours_open, theirs_open;
+  unsigned long ours_total, theirs_total, refused;
+};
+
+static int epoll_fd = -1;
+static flow_reply_fn reply_cb;
+static unsigned char *recv_buf;
+static int recv_size;
+
+/*
+ * now_sec()
+ * Seconds on the monotonic clock.
+ */
+static time_t now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+} /* now_sec */
+
+
+/*
+ * flow_init()
+ * Set up the epoll set for flow sockets; datagrams that come back on them
+ * are read into buf and passed to reply_fn.  Exit if anything goes wrong.
+ */
+void flow_init(flow_reply_fn reply_fn, unsigned char *buf, int size)
+{
+  reply_cb = reply_fn;
+  recv_buf = buf;
+  recv_size = size;
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("flow_init: epoll_create1");
+    exit(1);
+  }
+} /* flow_init */
+
+
+/*
+ * flow_fd()
+ * The epoll descriptor; readable when flow_poll() has work to do.
+ */
+int flow_fd(void)
+{
+  return epoll_fd;
+} /* flow_fd */
+
+
+/*
+ * flow_table_new()
+ * Allocate the flow table of a relay, for up to max flows each way.  ctx
+ * is passed to the reply function.  Exit if anything goes wrong.
+ */
+struct flow_table *flow_table_new(int max, void *ctx)
+{
+  struct flow_table *t;
+  unsigned int size = 1;
+  int i;
+
+  while (size < 2 * (unsigned int) max) size <<= 1;
+
+  if ((t = (struct flow_table *) calloc(1, sizeof(*t))) == NULL ||
+      (t->ours = (struct flow *) calloc(max, sizeof(struct flow))) == NULL ||
+      (t->theirs = (struct flow *) calloc(max, sizeof(struct flow))) == NULL ||
+      (t->hash = (int *) malloc(size * sizeof(int))) == NULL) {
+    perror("flow_table_new: calloc");
+    exit(1);
+  }
+  t->max = max;
+  t->hash_mask = size - 1;
+  t->ctx = ctx;
+  for (i = 0; i < size; i++) {
+    t->hash[i] = -1;
+  }
+  for (i = 0; i < max; i++) {
+    t->ours[i].sock = t->theirs[i].sock = -1;
+    t->ours[i].table = t->theirs[i].table = t;
+  }
+  return t;
+} /* flow_table_new */
+
+
+/*
+ * hash_addr()
+ * The hash chain for a UDP peer.
+ */
+static int *hash_addr(struct flow_table *t, const struct sockaddr_in *addr)
+{
+  uint32_t h = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port;
+
+  return &t->hash[(h ^ (h >> 16)) & t->hash_mask];
+} /* hash_addr */
+
+
+/*
+ * flow_by_addr()
+ * The ID of our flow for a UDP peer, opening one if needed.  Return -1 if
+ * the table is full.
+ */
+int flow_by_addr(struct flow_table *t, const struct sockaddr_in *addr,
+                 time_t now)
+{
+  int *head = hash_addr(t, addr);
+  struct flow *f;
+  int id, i;
+
+  for (id = *head; id != -1; id = f->next) {
+    f = &t->ours[id];
+    if (f->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+        f->addr.sin_port == addr->sin_port) {
+      f->last_used = now;
+      return id;
+    }
+  }
+
+  /* IDs are handed out round robin, so that one is not reused while the
+   * other side may still remember it. */
+  for (i = 0; i < t->max; i++) {
+    id = (t->next_id + i) % t->max;
+    if (t->ours[id].last_used == 0) break;
+  }
+  if (i == t->max) {
+    t->refused++;
+    return -1;
+  }
+  t->next_id = (id + 1) % t->max;
+
+  f = &t->ours[id];
+  f->addr = *addr;
+  f->last_used = now;
+  f->next = *head;
+  *head = id;
+  t->ours_open++;
+  t->ours_total++;
+  return id;
+} /* flow_by_addr */
+
+
+/*
+ * flow_addr()
+ * The UDP peer of our flow id, or NULL if there is no such flow.
+ */
+const struct sockaddr_in *flow_addr(struct flow_table *t, int id, time_t now)
+{
+  if (id >= t->max || t->ours[id].last_used == 0) {
+    return NULL;
+  }
+  t->ours[id].last_used = now;
+  return &t->ours[id].addr;
+} /* flow_addr */
+
+
+/*
+ * flow_socket()
+ * Our socket for the other side's flow id, opened and connected to dest
+ * if needed.  Return -1 if it cannot be opened.
+ */
+int flow_socket(struct flow_table *t, int id, const struct sockaddr_in *dest,
+                time_t now)
+{
+  struct flow *f;
+  struct epoll_event ev;
+
+  if (id >= t->max) {
+    t->refused++;
+    return -1;
+  }
+  f = &t->theirs[id];
+  f->last_used = now;
+  if (f->sock != -1) {
+    return f->sock;
+  }
+
+  if ((f->sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0)) < 0) {
+    perror("flow_socket: socket");
+    f->last_used = 0;
+    return -1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = f;
+  if (connect(f->sock, (struct sockaddr *) dest, sizeof(*dest)) < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, f->sock, &ev) < 0) {
+    perror("flow_socket: connect");
+    close(f->sock);
+    f->sock = -1;
+    f->last_used = 0;
+    return -1;
+  }
+  t->theirs_open++;
+  t->theirs_total++;
+  return f->sock;
+} /* flow_socket */
+
+
+/*
+ * flow_expire()
+ * Forget every flow not used since idle_since, closing its socket.
+ */
+void flow_expire(struct flow_table *t, time_t idle_since)
+{
+  struct flow *f;
+  int *link;
+  int id;
+
+  for (id = 0; id < t->max; id++) {
+    f = &t->ours[id];
+    if (f->last_used != 0 && f->last_used < idle_since) {
+      for (link = hash_addr(t, &f->addr); *link != id;
+           link = &t->ours[*link].next)
+        ;
+      *link = f->next;
+      f->last_used = 0;
+      t->ours_open--;
+    }
+
+    f = &t->theirs[id];
+    if (f->sock != -1 && f->last_used < idle_since) {
+      close(f->sock);    /* also removes it from the epoll set */
+      f->sock = -1;
+      f->last_used = 0;
+      t->theirs_open--;
+    }
+  }
+} /* flow_expire */
+
+
+/*
+ * flow_poll()
+ * Read what has come back on flow sockets, without blocking, and hand it
+ * to the reply function.  If we need to bail out, return non-zero.
+ */
+int flow_poll(void)
+{
+  struct epoll_event events[FLOW_EVENTS];
+  struct flow *f;
+  time_t now = now_sec();
+  int n, i, j, len;
+
+  if ((n = epoll_wait(epoll_fd, events, FLOW_EVENTS, 0)) < 0) {
+    if (errno == EINTR) return 0;
+    perror("flow_poll: epoll_wait");
+    return 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    f = events[i].data.ptr;
+    for (j = 0; j < FLOW_BATCH && f->sock != -1; j++) {
+      if ((len = recv(f->sock, recv_buf, recv_size, 0)) < 0) {
+        /* Nobody listening at the destination (yet) is not an error. */
+        if (errno == ECONNREFUSED || errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("flow_poll: recv");
+        }
+        break;
+      }
+      f->last_used = now;
+      if (reply_cb(f->table->ctx, f - f->table->theirs, recv_buf, len)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+} /* flow_poll */
+
+
+/*
+ * flow_stats()
+ * Print a relay's flow counters.
+ */
+void flow_stats(struct flow_table *t, FILE *out, int relay)
+{
+  fprintf(out, "Relay %d: flows: %d open, %lu opened here; %d open, %lu "
+          "opened by peer; %lu refused\n", relay, t->ours_open,
+          t->ours_total, t->theirs_open, t->theirs_total, t->refused);
+} /* flow_stats */
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+void flow_init(flow_reply_fn reply_fn, unsigned char *buf, int size)
+{
+  fprintf(stderr, "Flow multiplexing is not supported on this platform\n");
+  exit(2);
+} /* flow_init */
+
+int flow_fd(void) { return -1; }
+struct flow_table *flow_table_new(int max, void *ctx) { return NULL; }
+int flow_by_addr(struct flow_table *t, const struct sockaddr_in *addr,
+                 time_t now) { return -1; }
+const struct sockaddr_in *flow_addr(struct flow_table *t, int id,
+                                    time_t now) { return NULL; }
+int flow_socket(struct flow_table *t, int id, const struct sockaddr_in *dest,
+                time_t now) { return -1; }
+void flow_expire(struct flow_table *t, time_t idle_since) { }
+int flow_poll(void) { return 0; }
+void flow_stats(struct flow_table *t, FILE *out, int relay) { }
+
+#endif /* HAVE_SYS_EPOLL_H */
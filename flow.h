@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* Flow multiplexing for tunnel mode.  Each side numbers the UDP peers
+ * that send to its port, and tags their frames with that flow ID.  The
+ * other side gives each such flow its own UDP socket, so that the
+ * destination can tell the peers apart, and tunnels what comes back on it
+ * with the same ID and FLOW_REPLY set; the first side then sends it on
+ * to the peer from its port.  Flows idle for long enough are forgotten.
+ *
+ * Flow sockets are kept in an epoll set; flow_fd() is readable whenever
+ * flow_poll() has work to do. */
+
+#define FLOW_REPLY 0x8000      /* the flow was opened by the frame's receiver */
+#define FLOW_MAX 0x8000        /* flow IDs per side */
+
+struct flow_table;
+
+/* Handle a datagram that came back on the socket of the other side's
+ * flow id, in the buffer given to flow_init().  Return non-zero to bail
+ * out. */
+typedef int (*flow_reply_fn)(void *ctx, int id, unsigned char *data, int len);
+
+extern struct flow_table *flow_table_new(int max, void *ctx);
+extern int flow_by_addr(struct flow_table *t, const struct sockaddr_in *addr,
+                        time_t now);
+extern const struct sockaddr_in *flow_addr(struct flow_table *t, int id,
+                                           time_t now);
+extern int flow_socket(struct flow_table *t, int id,
+                       const struct sockaddr_in *dest, time_t now);
+extern void flow_expire(struct flow_table *t, time_t idle_since);
+extern void flow_stats(struct flow_table *t, FILE *out, int relay);
+
+extern void flow_init(flow_reply_fn reply_fn, unsigned char *buf, int size);
+extern int flow_fd(void);
+extern int flow_poll(void);
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+/*
+ * make_addr()
+ * Fill in a Unix socket address for path.  Exit if it is too long.
+ */
+static void make_addr(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "%s: handoff socket path too long\n", path);
+    exit(2);
+  }
+  strcpy(addr->sun_path, path);
+} /* make_addr */
+
+
+/*
+ * handoff_listen()
+ * Listen for a successor on path, replacing any stale socket there.
+ * Exit if anything goes wrong.
+ */
+int handoff_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  int sock;
+
+  make_addr(path, &addr);
+
+  if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+    perror("handoff_listen: socket");
+    exit(1);
+  }
+
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("handoff_listen: bind");
+    exit(1);
+  }
+
+  if (listen(sock, 1) < 0) {
+    perror("handoff_listen: listen");
+    exit(1);
+  }
+
+  return sock;
+} /* handoff_listen */
+
+
+/*
+ * handoff_connect()
+ * Connect to a running predecessor on path.  Return the socket, or -1 if
+ * nobody is listening there.
+ */
+int handoff_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int sock;
+
+  make_addr(path, &addr);
+
+  if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+    perror("handoff_connect: socket");
+    exit(1);
+  }
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+} /* handoff_connect */
+
+
+/*
+ * handoff_send()
+ * Send one message, passing nfds descriptors along with it.  Return
+ * non-zero on failure.
+ */
+int handoff_send(int sock, const void *data, size_t len,
+                 const int *fds, int nfds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+
+  if (nfds > HANDOFF_MAX_FDS) {
+    return 1;
+  }
+
+  iov.iov_base = (void *) data;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (nfds > 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+
+  while (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) len) {
+    if (errno != EINTR) {
+      perror("handoff_send: sendmsg");
+      return 1;
+    }
+  }
+  return 0;
+} /* handoff_send */
+
+
+/*
+ * handoff_recv()
+ * Receive one message of at most len bytes.  On entry *nfds is the room
+ * in fds; on return, the number of descriptors received, which are made
+ * close-on-exec.  Return the message length, or -1 on failure or EOF.
+ */
+ssize_t handoff_recv(int sock, void *data, size_t len, int *fds, int *nfds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  ssize_t n;
+  int room = *nfds, got = 0, i;
+
+  iov.iov_base = data;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+    if (errno != EINTR) {
+      perror("handoff_recv: recvmsg");
+      return -1;
+    }
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int *passed = (int *) CMSG_DATA(cmsg);
+
+      for (i = 0; i < count; i++) {
+        if (got < room) {
+          fds[got++] = passed[i];
+        }
+        else {
+          close(passed[i]);
+        }
+      }
+    }
+  }
+  *nfds = got;
+
+  if (n == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    for (i = 0; i < got; i++) close(fds[i]);
+    *nfds = 0;
+    return -1;
+  }
+  return n;
+} /* handoff_recv */
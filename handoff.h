@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Hot restart: a running udptunnel listens on a Unix socket, and a newly
+ * started one connects to it to take over its sockets (passed with
+ * SCM_RIGHTS) and session state.  Messages are SOCK_SEQPACKET, so each
+ * send is received whole. */
+
+#define HANDOFF_MAGIC 0x55445448     /* "UDTH" */
+#define HANDOFF_VERSION 3
+#define HANDOFF_MAX_FDS 250          /* descriptors per message */
+
+/* The successor's opening message, echoed back with status set to 0 if
+ * the predecessor will hand over.  The successor sends it once more, when
+ * it has taken over, for the predecessor to exit. */
+struct handoff_hello {
+  uint32_t magic, version;
+  int32_t relay_count, is_server, device_port, output_format;
+  int32_t tunnel_mode, stripe_count;
+  int32_t status;
+};
+
+extern int handoff_listen(const char *path);
+extern int handoff_connect(const char *path);
+extern int handoff_send(int sock, const void *data, size_t len,
+                        const int *fds, int nfds);
+extern ssize_t handoff_recv(int sock, void *data, size_t len,
+                            int *fds, int *nfds);
@@ -1,10 +1,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>      /* struct sockaddr */
 #include <stdlib.h>
-#include <netdb.h>           /* gethostbyname() */
+#include <string.h>
+#include <netdb.h>           /* getaddrinfo() */
 #include <netinet/in.h>      /* sockaddr_in */
 #include <arpa/inet.h>       /* inet_addr() */
-#include <rpcsvc/ypclnt.h>   /* YP */
 #include <ctype.h>           /* isspace() */
 
 #include "host2ip.h"
@@ -15,17 +15,25 @@ static char rcsid[]  = "$Id: host2ip.c,v 1.1 1996/09/20 12:49:19 sho Exp $";
 * NOTE: always include the correct function prototype,
 *    extern int host2ip(char *host);
 * is not correct and will cause memory problems.
+*
+* Names are looked up with getaddrinfo(), which consults the system's name
+* service switch (hosts file, DNS, NIS, ...) instead of going to DNS and
+* YP separately.  This blocks; it is only meant for use during startup.
+* Anything that has to be resolved again later goes through resolver.h.
 */
 struct in_addr host2ip(char *host)
 {
   struct in_addr in, tmp;
-  struct hostent *hep;
+  struct addrinfo hints, *res;
 
   /* Strip leading white space. */
   if (host) {
     while (*host && isspace((int)*host)) host++;  
   }
 
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+
   /* Check whether this is a dotted decimal. */
   if (!host) {
     in.s_addr = INADDR_ANY;
@@ -33,23 +41,14 @@ struct in_addr host2ip(char *host)
   else if ((tmp.s_addr = inet_addr(host)) != -1) {
     in = tmp;
   }
-  /* Attempt to resolve host name via DNS. */
-  else if ((hep = gethostbyname(host))) {
-    in = *(struct in_addr *)(hep->h_addr_list[0]);
+  /* Attempt to resolve host name. */
+  else if (getaddrinfo(host, NULL, &hints, &res) == 0) {
+    in = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
   }
-  /* As a last resort, try YP. */
   else {
-    static char *domain = 0;  /* YP domain */
-    char *value;              /* key value */
-    int value_len;            /* length of returned value */
-
-    if (!domain) yp_get_default_domain(&domain);
-    if (yp_match(domain, "hosts.byname", host, strlen(host), &value, &value_len) == 0) {
-      in.s_addr = inet_addr(value);
-    } else {
-      /* Everything failed */
-      in.s_addr = INADDR_ANY;
-    }
+    /* Everything failed */
+    in.s_addr = INADDR_ANY;
   }
   return in;
 } /* host2ip */
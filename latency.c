@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+struct histogram {
+  uint64_t count[LATENCY_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+static struct histogram histograms[LAT_STAGES];
+static FILE *trace_file = NULL;
+
+static const char *stage_names[LAT_STAGES] = {
+  "recv", "parse", "format", "send", "total"
+};
+
+/*
+ * latency_now()
+ * Nanoseconds on the monotonic clock.
+ */
+uint64_t latency_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} /* latency_now */
+
+
+/*
+ * latency_record()
+ * Add one sample to a stage's histogram.  Bucket b counts samples in
+ * [2^(b-1), 2^b) ns; bucket 0 counts zero.
+ */
+void latency_record(enum latency_stage stage, uint64_t ns)
+{
+  struct histogram *h = &histograms[stage];
+  int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+  h->count[bucket]++;
+  h->total++;
+  if (ns > h->max) h->max = ns;
+} /* latency_record */
+
+
+/*
+ * percentile()
+ * Upper bound, in ns, of the bucket holding the given percentile (but no
+ * more than the largest sample).
+ */
+static uint64_t percentile(const struct histogram *h, int pct)
+{
+  uint64_t want = (h->total * pct + 99) / 100, seen = 0;
+  int b;
+
+  for (b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->count[b];
+    if (seen >= want) {
+      if (b == 0) return 0;
+      return ((uint64_t)1 << b) < h->max ? (uint64_t)1 << b : h->max;
+    }
+  }
+  return h->max;
+} /* percentile */
+
+
+/*
+ * latency_dump()
+ * Print a summary of every stage's histogram.
+ */
+void latency_dump(FILE *out)
+{
+  int i;
+
+  for (i = 0; i < LAT_STAGES; i++) {
+    const struct histogram *h = &histograms[i];
+
+    if (h->total == 0) continue;
+    fprintf(out, "Latency %-6s n=%llu p50<%.1fus p90<%.1fus p99<%.1fus "
+            "max=%.1fus\n", stage_names[i], (unsigned long long) h->total,
+            percentile(h, 50) / 1000.0, percentile(h, 90) / 1000.0,
+            percentile(h, 99) / 1000.0, h->max / 1000.0);
+  }
+  latency_flush_trace();
+} /* latency_dump */
+
+
+/*
+ * latency_open_trace()
+ * Start writing sampled packet traces to path.  Exit on failure.
+ */
+void latency_open_trace(const char *path)
+{
+  uint32_t header[4];
+
+  if ((trace_file = fopen(path, "wb")) == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  header[0] = LATENCY_TRACE_MAGIC;
+  header[1] = LATENCY_TRACE_VERSION;
+  header[2] = sizeof(struct latency_trace_record);
+  header[3] = 0;
+  if (fwrite(header, sizeof(header), 1, trace_file) != 1) {
+    perror(path);
+    exit(1);
+  }
+} /* latency_open_trace */
+
+
+/*
+ * latency_trace()
+ * Append a record to the trace file, if one is open.  Writes are
+ * buffered; a failure closes the file rather than stopping the relay.
+ */
+void latency_trace(const struct latency_trace_record *rec)
+{
+  if (trace_file == NULL) return;
+
+  if (fwrite(rec, sizeof(*rec), 1, trace_file) != 1) {
+    perror("latency_trace: fwrite");
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+} /* latency_trace */
+
+
+/*
+ * latency_flush_trace()
+ * Push buffered trace records out to the file.
+ */
+void latency_flush_trace(void)
+{
+  if (trace_file != NULL) fflush(trace_file);
+} /* latency_flush_trace */
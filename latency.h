@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/* Per-packet latency accounting.  Each stage has a histogram with
+ * power-of-two nanosecond buckets.  Only the I/O loop updates them, and
+ * they are read from the same thread (on SIGUSR1), so no locking is
+ * needed.  Sampled packets can also be logged to a binary trace file. */
+
+enum latency_stage {
+  LAT_RECV = 0,    /* kernel receive timestamp to recvmsg() returning */
+  LAT_PARSE,       /* recvmsg() returning to the record being decoded */
+  LAT_FORMAT,      /* decoded to the output record being formatted */
+  LAT_SEND,        /* formatted to its send() completing */
+  LAT_TOTAL,       /* kernel receive timestamp to send() completing */
+  LAT_STAGES
+};
+
+#define LATENCY_BUCKETS 64
+
+/* One trace file record, in host byte order, after a 16-byte header
+ * holding LATENCY_TRACE_MAGIC, LATENCY_TRACE_VERSION, the record size
+ * and a zero pad word, each a uint32_t. */
+#define LATENCY_TRACE_MAGIC 0x52545455   /* "UTTR" */
+#define LATENCY_TRACE_VERSION 1
+
+struct latency_trace_record {
+  uint64_t rx_time;              /* kernel receive time, ns since epoch */
+  uint32_t stage[LAT_STAGES];    /* ns spent in each stage */
+  uint16_t length;               /* UDP payload length */
+  uint16_t device;               /* nameMap index */
+};
+
+extern uint64_t latency_now(void);
+extern void latency_record(enum latency_stage stage, uint64_t ns);
+extern void latency_dump(FILE *out);
+extern void latency_open_trace(const char *path);
+extern void latency_trace(const struct latency_trace_record *rec);
+extern void latency_flush_trace(void);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "resolver.h"
+
+#define RESOLVER_SLOTS 16
+#define RESOLVER_NEGATIVE_TTL 5   /* seconds to remember a failed lookup */
+#define RESOLVER_ADDRS 8          /* addresses kept per host */
+
+struct cache_entry {
+  char host[NI_MAXHOST];
+  enum {empty = 0, queued, querying, resolved, failed} state;
+  time_t expires;
+  int addr_count, addr_next;      /* addresses, and the one to hand out */
+  struct sockaddr_storage addr[RESOLVER_ADDRS];
+  socklen_t addrlen[RESOLVER_ADDRS];
+};
+
+static struct cache_entry cache[RESOLVER_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static int notify_pipe[2] = {-1, -1};
+static int cache_ttl;
+static resolver_func lookup_func = getaddrinfo;
+static void (*release_func)(struct addrinfo *) = freeaddrinfo;
+
+/*
+ * now_sec()
+ * Seconds on the monotonic clock.
+ */
+static time_t now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+} /* now_sec */
+
+
+/*
+ * resolver_thread()
+ * Take queued entries off the cache one at a time and resolve them with
+ * getaddrinfo(), which goes through the system's NSS configuration (hosts
+ * file, DNS, NIS, ...).  The lock is not held during the lookup itself.
+ */
+static void *resolver_thread(void *arg)
+{
+  struct cache_entry *e;
+  char host[NI_MAXHOST];
+  struct addrinfo hints, *res, *ai;
+  int i, err;
+
+  for (;;) {
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+      e = NULL;
+      for (i = 0; i < RESOLVER_SLOTS; i++) {
+        if (cache[i].state == queued) {
+          e = &cache[i];
+          break;
+        }
+      }
+      if (e != NULL) break;
+      pthread_cond_wait(&cache_cond, &cache_lock);
+    }
+    e->state = querying;
+    strcpy(host, e->host);
+    pthread_mutex_unlock(&cache_lock);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    err = lookup_func(host, NULL, &hints, &res);
+
+    pthread_mutex_lock(&cache_lock);
+    if (err == 0) {
+      /* Keep them all, in the order given, so that resolver_forget() can
+       * move on to the next (IPv4 when IPv6 is broken, say). */
+      e->addr_count = 0;
+      for (ai = res; ai != NULL && e->addr_count < RESOLVER_ADDRS;
+           ai = ai->ai_next) {
+        if (ai->ai_addrlen <= sizeof(e->addr[0])) {
+          memcpy(&e->addr[e->addr_count], ai->ai_addr, ai->ai_addrlen);
+          e->addrlen[e->addr_count++] = ai->ai_addrlen;
+        }
+      }
+      e->addr_next = 0;
+      e->state = e->addr_count != 0 ? resolved : failed;
+      e->expires = now_sec() + (e->addr_count != 0 ? cache_ttl :
+                                RESOLVER_NEGATIVE_TTL);
+      release_func(res);
+    }
+    else {
+      fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+      e->state = failed;
+      e->expires = now_sec() + RESOLVER_NEGATIVE_TTL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    while (write(notify_pipe[1], "", 1) < 0 && errno == EINTR)
+      ;
+  }
+  return NULL;
+} /* resolver_thread */
+
+
+/*
+ * resolver_init()
+ * Start the resolver thread.  Successful lookups are cached for ttl
+ * seconds.  Exit if anything goes wrong.
+ */
+void resolver_init(int ttl)
+{
+  pthread_t thread;
+  int err;
+
+  cache_ttl = ttl;
+
+  if (pipe(notify_pipe) < 0) {
+    perror("resolver_init: pipe");
+    exit(1);
+  }
+  fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(notify_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(notify_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  if ((err = pthread_create(&thread, NULL, resolver_thread, NULL)) != 0) {
+    fprintf(stderr, "resolver_init: pthread_create: %s\n", strerror(err));
+    exit(1);
+  }
+  pthread_detach(thread);
+} /* resolver_init */
+
+
+/*
+ * resolver_set_lookup()
+ * Resolve names with lookup, and free its answers with release, instead
+ * of getaddrinfo() and freeaddrinfo().  For tests; call while no lookup
+ * is in flight.
+ */
+void resolver_set_lookup(resolver_func lookup,
+                         void (*release)(struct addrinfo *))
+{
+  lookup_func = lookup;
+  release_func = release;
+} /* resolver_set_lookup */
+
+
+/*
+ * resolver_fd()
+ * A descriptor that becomes readable whenever a lookup completes.
+ */
+int resolver_fd(void)
+{
+  return notify_pipe[0];
+} /* resolver_fd */
+
+
+/*
+ * resolver_drain()
+ * Consume completion notifications; call when resolver_fd() is readable.
+ */
+void resolver_drain(void)
+{
+  char junk[64];
+
+  while (read(notify_pipe[0], junk, sizeof(junk)) > 0)
+    ;
+} /* resolver_drain */
+
+
+/*
+ * resolver_lookup()
+ * Look host up in the cache.  On RESOLVE_OK, the address to try (with
+ * port 0) is copied to *addr.  If there is no fresh entry, a lookup is queued and
+ * RESOLVE_PENDING returned; ask again once resolver_fd() is readable.
+ */
+enum resolver_status resolver_lookup(const char *host,
+                                     struct sockaddr_storage *addr,
+                                     socklen_t *addrlen)
+{
+  struct cache_entry *e = NULL, *victim = NULL;
+  enum resolver_status status;
+  time_t now = now_sec();
+  int i;
+
+  if (strlen(host) >= NI_MAXHOST) {
+    return RESOLVE_FAILED;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  for (i = 0; i < RESOLVER_SLOTS; i++) {
+    if (cache[i].state != empty && strcmp(cache[i].host, host) == 0) {
+      e = &cache[i];
+      break;
+    }
+    /* Reuse the idle entry that expires soonest. */
+    if (cache[i].state != queued && cache[i].state != querying &&
+        (victim == NULL || cache[i].expires < victim->expires)) {
+      victim = &cache[i];
+    }
+  }
+
+  if (e != NULL && (e->state == queued || e->state == querying)) {
+    status = RESOLVE_PENDING;
+  }
+  else if (e != NULL && now < e->expires) {
+    if (e->state == resolved) {
+      memcpy(addr, &e->addr[e->addr_next], e->addrlen[e->addr_next]);
+      *addrlen = e->addrlen[e->addr_next];
+      status = RESOLVE_OK;
+    }
+    else {
+      status = RESOLVE_FAILED;
+    }
+  }
+  else {
+    if (e == NULL) e = victim;
+    if (e == NULL) {
+      /* Every slot has a lookup in flight; try again later. */
+      status = RESOLVE_PENDING;
+    }
+    else {
+      strcpy(e->host, host);
+      e->state = queued;
+      pthread_cond_signal(&cache_cond);
+      status = RESOLVE_PENDING;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  return status;
+} /* resolver_lookup */
+
+
+/*
+ * resolver_forget()
+ * The address last handed out for host does not work.  Move on to the
+ * next one the name service gave; once they have all been tried, expire
+ * the entry so that the next lookup goes back to the name service.
+ */
+void resolver_forget(const char *host)
+{
+  struct cache_entry *e;
+  int i;
+
+  pthread_mutex_lock(&cache_lock);
+  for (i = 0; i < RESOLVER_SLOTS; i++) {
+    e = &cache[i];
+    if ((e->state == resolved || e->state == failed) &&
+        strcmp(e->host, host) == 0) {
+      if (e->state == resolved && ++e->addr_next < e->addr_count) {
+        continue;
+      }
+      e->addr_next = 0;
+      e->expires = 0;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+} /* resolver_forget */
@@ -0,0 +1,30 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* Asynchronous host name resolution with a TTL cache.  Lookups run on a
+ * dedicated thread, so the caller never blocks on DNS; it is told through
+ * resolver_fd() when a queued lookup has completed and should ask again.
+ * Every address of a host is kept; resolver_forget() moves on to the next
+ * when one does not work, and resolver_set_lookup() lets tests (see
+ * resolvertest.c) stand in for the name service. */
+
+enum resolver_status {
+  RESOLVE_OK = 0,
+  RESOLVE_PENDING,
+  RESOLVE_FAILED
+};
+
+typedef int (*resolver_func)(const char *host, const char *service,
+                             const struct addrinfo *hints,
+                             struct addrinfo **res);
+
+extern void resolver_set_lookup(resolver_func lookup,
+                                void (*release)(struct addrinfo *));
+extern void resolver_init(int ttl);
+extern int resolver_fd(void);
+extern void resolver_drain(void);
+extern enum resolver_status resolver_lookup(const char *host,
+                                            struct sockaddr_storage *addr,
+                                            socklen_t *addrlen);
+extern void resolver_forget(const char *host);
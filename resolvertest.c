@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "resolver.h"
+
+/* Check the resolver: that a name in the hosts file resolves through the
+ * system's name service, and, against a stub standing in for it, that
+ * every address of a host is kept and handed out in turn by
+ * resolver_forget() before the host is looked up again, and that failed
+ * lookups are remembered.  Run by "make check"; exits non-zero if a check
+ * fails. */
+
+#define TEST_TTL 60
+#define TEST_WAIT 5000      /* milliseconds to wait for a lookup */
+
+struct stub_host {
+  const char *host;
+  const char *addrs[3];     /* numeric, NULL-terminated */
+  int calls;
+};
+
+static struct stub_host stub_hosts[] = {
+  {"dual.test", {"2001:db8::1", "192.0.2.1", NULL}, 0},
+  {"single.test", {"192.0.2.2", NULL}, 0},
+  {"gone.test", {NULL}, 0}
+};
+
+#define STUB_HOSTS (sizeof(stub_hosts) / sizeof(stub_hosts[0]))
+
+/*
+ * stub_free()
+ * Free a list made by stub_lookup().
+ */
+static void stub_free(struct addrinfo *res)
+{
+  struct addrinfo *next;
+
+  for (; res != NULL; res = next) {
+    next = res->ai_next;
+    free(res->ai_addr);
+    free(res);
+  }
+} /* stub_free */
+
+
+/*
+ * stub_lookup()
+ * Answer for the hosts in stub_hosts as getaddrinfo() would, counting
+ * the lookups of each.
+ */
+static int stub_lookup(const char *host, const char *service,
+                       const struct addrinfo *hints, struct addrinfo **res)
+{
+  struct addrinfo *ai, **tail = res;
+  struct sockaddr_in6 *sin6;
+  struct sockaddr_in *sin;
+  unsigned i;
+  int j;
+
+  *res = NULL;
+  for (i = 0; i < STUB_HOSTS; i++) {
+    if (strcmp(stub_hosts[i].host, host) == 0) break;
+  }
+  if (i == STUB_HOSTS || stub_hosts[i].addrs[0] == NULL) {
+    if (i < STUB_HOSTS) stub_hosts[i].calls++;
+    return EAI_NONAME;
+  }
+  stub_hosts[i].calls++;
+
+  for (j = 0; stub_hosts[i].addrs[j] != NULL; j++) {
+    if ((ai = calloc(1, sizeof(*ai))) == NULL ||
+        (ai->ai_addr = calloc(1, sizeof(struct sockaddr_in6))) == NULL) {
+      perror("stub_lookup: calloc");
+      exit(1);
+    }
+    ai->ai_socktype = SOCK_STREAM;
+    if (strchr(stub_hosts[i].addrs[j], ':') != NULL) {
+      sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+      sin6->sin6_family = ai->ai_family = AF_INET6;
+      inet_pton(AF_INET6, stub_hosts[i].addrs[j], &sin6->sin6_addr);
+      ai->ai_addrlen = sizeof(*sin6);
+    }
+    else {
+      sin = (struct sockaddr_in *) ai->ai_addr;
+      sin->sin_family = ai->ai_family = AF_INET;
+      inet_pton(AF_INET, stub_hosts[i].addrs[j], &sin->sin_addr);
+      ai->ai_addrlen = sizeof(*sin);
+    }
+    *tail = ai;
+    tail = &ai->ai_next;
+  }
+  return 0;
+} /* stub_lookup */
+
+
+/*
+ * lookup()
+ * Look host up, waiting for the resolver thread if need be, and write
+ * the address found to text.  Return the final status.
+ */
+static enum resolver_status lookup(const char *host, char *text, int len)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct pollfd pfd;
+  enum resolver_status status;
+
+  strcpy(text, "-");
+  while ((status = resolver_lookup(host, &addr, &addrlen)) ==
+         RESOLVE_PENDING) {
+    pfd.fd = resolver_fd();
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, TEST_WAIT) <= 0) {
+      fprintf(stderr, "%s: lookup timed out\n", host);
+      return status;
+    }
+    resolver_drain();
+  }
+
+  if (status == RESOLVE_OK) {
+    if (addr.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr,
+                text, len);
+    }
+    else {
+      inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr,
+                text, len);
+    }
+  }
+  return status;
+} /* lookup */
+
+
+/*
+ * expect()
+ * Look host up and check the status, the address and the number of
+ * stub lookups made so far (-1: don't care).  Return 1 on mismatch.
+ */
+static int expect(const char *host, enum resolver_status status,
+                  const char *addr, int calls)
+{
+  char text[INET6_ADDRSTRLEN];
+  enum resolver_status got;
+  unsigned i;
+
+  got = lookup(host, text, sizeof(text));
+  if (got != status || (addr != NULL && strcmp(text, addr) != 0)) {
+    fprintf(stderr, "%s: got status %d address %s, expected %d %s\n",
+            host, got, text, status, addr != NULL ? addr : "");
+    return 1;
+  }
+
+  for (i = 0; i < STUB_HOSTS; i++) {
+    if (strcmp(stub_hosts[i].host, host) == 0 && calls != -1 &&
+        stub_hosts[i].calls != calls) {
+      fprintf(stderr, "%s: %d lookups made, expected %d\n", host,
+              stub_hosts[i].calls, calls);
+      return 1;
+    }
+  }
+  return 0;
+} /* expect */
+
+
+int main(int argc, char *argv[])
+{
+  char text[INET6_ADDRSTRLEN];
+  int failed = 0;
+
+  resolver_init(TEST_TTL);
+
+  /* The real name service: localhost is in any hosts file. */
+  if (lookup("localhost", text, sizeof(text)) != RESOLVE_OK ||
+      (strcmp(text, "127.0.0.1") != 0 && strcmp(text, "::1") != 0)) {
+    fprintf(stderr, "localhost: resolved to %s\n", text);
+    failed++;
+  }
+
+  resolver_set_lookup(stub_lookup, stub_free);
+
+  /* Each address in turn, from the cache; then a fresh lookup. */
+  failed += expect("dual.test", RESOLVE_OK, "2001:db8::1", 1);
+  failed += expect("dual.test", RESOLVE_OK, "2001:db8::1", 1);
+  resolver_forget("dual.test");
+  failed += expect("dual.test", RESOLVE_OK, "192.0.2.1", 1);
+  resolver_forget("dual.test");
+  failed += expect("dual.test", RESOLVE_OK, "2001:db8::1", 2);
+
+  failed += expect("single.test", RESOLVE_OK, "192.0.2.2", 1);
+  resolver_forget("single.test");
+  failed += expect("single.test", RESOLVE_OK, "192.0.2.2", 2);
+
+  /* A failure is remembered, and forgetting it asks again. */
+  failed += expect("gone.test", RESOLVE_FAILED, NULL, 1);
+  failed += expect("gone.test", RESOLVE_FAILED, NULL, 1);
+  resolver_forget("gone.test");
+  failed += expect("gone.test", RESOLVE_FAILED, NULL, 2);
+
+  /* Other hosts keep their place meanwhile. */
+  failed += expect("dual.test", RESOLVE_OK, "2001:db8::1", 2);
+
+  if (failed != 0) {
+    fprintf(stderr, "%d resolver checks failed\n", failed);
+    exit(1);
+  }
+  return 0;
+} /* main */
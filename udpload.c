@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Load generator for benchmarking a udptunnel on this host (see
+ * bench.sh).
+ *
+ *   udpload wir -u UDP-PORT -t TCP-PORT -r RATE -d SECS [-k PID] IMEI...
+ *
+ * connects to the TCP port of "udptunnel -s", registers each IMEI from a
+ * UDP socket of its own, and sends single-record Codec8 packets from them
+ * in turn at RATE packets a second for SECS seconds, reading the WIR
+ * output as it goes.  It reports the rate achieved at both ends; the
+ * latency is udptunnel's own (--latency-stats), which -k has it print
+ * by sending it SIGUSR1 before the connection is closed (which makes it
+ * exit).
+ *
+ *   udpload tunnel -u UDP-PORT -o OUT-PORT -r RATE -d SECS [-f FLOWS] [-s SIZE]
+ *
+ * sends SIZE-byte datagrams stamped with their send time from FLOWS
+ * sockets in turn to the UDP port of "udptunnel -c --tunnel", receives
+ * them on OUT-PORT as the far end's udptunnel delivers them, and reports
+ * the one-way latency percentiles and the loss.
+ *
+ *   udpload proxy -l LISTEN-PORT -t TCP-PORT [-p PERMILLE] [-w MSECS]
+ *
+ * relays each TCP connection made to LISTEN-PORT to TCP-PORT until
+ * killed, and after each read in the forward direction, with probability
+ * PERMILLE/1000, stops reading that connection for MSECS milliseconds:
+ * the head-of-line stall a lost segment causes while it is retransmitted.
+ * It stands in for netem where that is not available. */
+
+#define LOAD_HOST "127.0.0.1"
+#define LOAD_TICK_NS 1000000         /* pacing interval */
+#define LOAD_DRAIN_MS 1000           /* to wait for output after sending */
+#define LOAD_STATS_MS 300            /* for udptunnel to print its stats */
+#define LOAD_MAX_DEVICES 64
+#define LOAD_IMEI_LEN 15
+#define LOAD_MAX_FLOWS 1024
+#define LOAD_BUCKET_NS 10000         /* latency histogram resolution */
+#define LOAD_BUCKETS 100000          /* up to one second; above is counted
+                                        in the last bucket */
+#define LOAD_MAX_CONNS 64            /* proxied connections */
+#define LOAD_CHUNK 16384             /* proxied bytes per read */
+#define LOAD_RCVBUF (8 << 20)        /* for the bursts after a stall */
+
+/* The start of every tunnel mode datagram. */
+struct stamp {
+  uint64_t sent_ns;
+  uint32_t seq;
+};
+
+/* A proxied connection: from the client (down) to the server (up). */
+struct proxy_conn {
+  int down, up;
+  uint64_t stalled_until;
+};
+
+/*
+ * now_ns()
+ * Nanoseconds on the monotonic clock.
+ */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} /* now_ns */
+
+
+/*
+ * usage()
+ * Print the program usage info, and exit.
+ */
+static void usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s wir -u UDP-port -t TCP-port -r RATE -d SECS [-k PID] IMEI...\n",
+          progname);
+  fprintf(stderr, "    or %s tunnel -u UDP-port -o out-port -r RATE -d SECS [-f FLOWS] [-s SIZE]\n",
+          progname);
+  fprintf(stderr, "    or %s proxy -l listen-port -t TCP-port [-p PERMILLE] [-w MSECS]\n",
+          progname);
+  exit(2);
+} /* usage */
+
+
+/*
+ * put32()
+ * Store v big-endian at p.
+ */
+static void put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+} /* put32 */
+
+
+/*
+ * crc16()
+ * The CRC-16/IBM of len bytes at p, as Codec8 frames carry it.
+ */
+static uint16_t crc16(const unsigned char *p, int len)
+{
+  uint16_t crc = 0;
+  int i;
+
+  while (len-- > 0) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+} /* crc16 */
+
+
+/*
+ * codec8_packet()
+ * Write a Codec8 packet of one record, stamped now and moved a little
+ * along by seq, to p.  Return its length.
+ */
+static int codec8_packet(unsigned char *p, uint32_t seq)
+{
+  struct timespec ts;
+  uint64_t ms;
+  unsigned char *d = p + 8;
+  int len;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  memset(p, 0, 8);
+  *d++ = 0x08;                            /* codec ID */
+  *d++ = 1;                               /* records */
+  put32(d, ms >> 32);
+  put32(d + 4, ms);
+  d[8] = 0;                               /* priority */
+  put32(d + 9, -37000000);                /* longitude */
+  put32(d + 13, 404000000 + seq % 1000);  /* latitude */
+  d[17] = 0; d[18] = 100;                 /* altitude */
+  d[19] = 0; d[20] = 90;                  /* heading */
+  d[21] = 8;                              /* satellites */
+  d[22] = 0; d[23] = 50;                  /* speed */
+  d += 24;
+  *d++ = 0;                               /* event IO ID */
+  *d++ = 1;                               /* IO elements */
+  *d++ = 0;                               /* 1-byte ones */
+  *d++ = 1;                               /* 2-byte ones: */
+  *d++ = 25;                              /* temperature */
+  *d++ = 2150 >> 8;
+  *d++ = 2150 & 0xff;
+  *d++ = 0;                               /* 4-byte ones */
+  *d++ = 0;                               /* 8-byte ones */
+  *d++ = 1;                               /* records, again */
+
+  len = d - (p + 8);
+  put32(p + 4, len);
+  put32(d, crc16(p + 8, len));
+  return len + 12;
+} /* codec8_packet */
+
+
+/*
+ * udp_socket()
+ * A UDP socket connected to port on LOAD_HOST.  Exit on failure.
+ */
+static int udp_socket(int port)
+{
+  struct sockaddr_in addr;
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, LOAD_HOST, &addr.sin_addr);
+
+  if ((sock = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ||
+      connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("udp_socket");
+    exit(1);
+  }
+  return sock;
+} /* udp_socket */
+
+
+/*
+ * bound_socket()
+ * A socket of the given type bound to port on LOAD_HOST, sharing the
+ * port with udptunnel's wildcard socket there.  Exit on failure.
+ */
+static int bound_socket(int type, int port)
+{
+  struct sockaddr_in addr;
+  int sock, opt = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, LOAD_HOST, &addr.sin_addr);
+
+  if ((sock = socket(PF_INET, type, 0)) < 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&opt,
+                 sizeof(opt)) < 0 ||
+      bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("bound_socket");
+    exit(1);
+  }
+  return sock;
+} /* bound_socket */
+
+
+/*
+ * tcp_connect()
+ * A non-blocking TCP connection to port on LOAD_HOST.  Exit on failure.
+ */
+static int tcp_connect(int port)
+{
+  struct sockaddr_in addr;
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, LOAD_HOST, &addr.sin_addr);
+
+  if ((sock = socket(PF_INET, SOCK_STREAM, 0)) < 0 ||
+      connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("tcp_connect");
+    exit(1);
+  }
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  return sock;
+} /* tcp_connect */
+
+
+/*
+ * drain_wir()
+ * Read what WIR output there is on sock, adding the lines to *records and
+ * the bytes to *bytes.  Exit if udptunnel has gone.
+ */
+static void drain_wir(int sock, uint64_t *records, uint64_t *bytes)
+{
+  static char buf[65536];
+  ssize_t n, i;
+
+  while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) {
+    *bytes += n;
+    for (i = 0; i < n; i++) {
+      *records += buf[i] == '|';
+    }
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    fprintf(stderr, "udpload: TCP connection lost\n");
+    exit(1);
+  }
+} /* drain_wir */
+
+
+/*
+ * pace()
+ * Return how many packets should have gone by now to keep to rate since
+ * start, and sleep a tick first if none are due.
+ */
+static uint64_t pace(uint64_t start, long rate, uint64_t sent)
+{
+  struct timespec tick = {0, LOAD_TICK_NS};
+  uint64_t due;
+
+  due = (now_ns() - start) * rate / 1000000000;
+  if (due <= sent) {
+    nanosleep(&tick, NULL);
+    due = (now_ns() - start) * rate / 1000000000;
+  }
+  return due;
+} /* pace */
+
+
+/*
+ * load_wir()
+ * The wir mode: see the top of this file.
+ */
+static void load_wir(int udp_port, int tcp_port, long rate, int secs,
+                     pid_t stats_pid, char **imeis, int count)
+{
+  unsigned char pkt[128];
+  int socks[LOAD_MAX_DEVICES];
+  uint64_t start, end, due, sent = 0, records = 0, bytes = 0;
+  struct pollfd pfd;
+  int tcp, i, len;
+
+  tcp = tcp_connect(tcp_port);
+  for (i = 0; i < count; i++) {
+    socks[i] = udp_socket(udp_port);
+    pkt[0] = 0;
+    pkt[1] = LOAD_IMEI_LEN;
+    memcpy(pkt + 2, imeis[i], LOAD_IMEI_LEN);
+    if (send(socks[i], pkt, LOAD_IMEI_LEN + 2, 0) < 0) {
+      perror("load_wir: send");
+      exit(1);
+    }
+  }
+  usleep(200000);   /* for the registrations to be taken */
+
+  start = now_ns();
+  end = start + (uint64_t)secs * 1000000000;
+  while (now_ns() < end) {
+    due = pace(start, rate, sent);
+    while (sent < due) {
+      len = codec8_packet(pkt, sent);
+      if (send(socks[sent % count], pkt, len, 0) < 0 && errno != ECONNREFUSED) {
+        perror("load_wir: send");
+        exit(1);
+      }
+      sent++;
+    }
+    drain_wir(tcp, &records, &bytes);
+  }
+  end = now_ns();
+
+  pfd.fd = tcp;
+  pfd.events = POLLIN;
+  while (records < sent && poll(&pfd, 1, LOAD_DRAIN_MS) > 0) {
+    drain_wir(tcp, &records, &bytes);
+  }
+
+  if (stats_pid != 0) {
+    kill(stats_pid, SIGUSR1);
+    usleep(LOAD_STATS_MS * 1000);
+  }
+
+  printf("sent %llu packets in %.2f s (%.0f/s); received %llu records "
+         "(%.0f/s), %llu bytes\n", (unsigned long long) sent,
+         (end - start) / 1e9, sent * 1e9 / (end - start),
+         (unsigned long long) records, records * 1e9 / (end - start),
+         (unsigned long long) bytes);
+} /* load_wir */
+
+
+/*
+ * drain_tunnel()
+ * Read the datagrams waiting on sock into the latency histogram.
+ */
+static void drain_tunnel(int sock, uint32_t *histogram, uint64_t *received,
+                         uint64_t *max_ns)
+{
+  static unsigned char buf[65536];
+  struct stamp st;
+  uint64_t ns, now;
+  ssize_t n;
+
+  while ((n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+    if (n < (ssize_t) sizeof(st)) continue;
+    now = now_ns();
+    memcpy(&st, buf, sizeof(st));
+    ns = now - st.sent_ns;
+    histogram[ns / LOAD_BUCKET_NS < LOAD_BUCKETS ? ns / LOAD_BUCKET_NS
+                                                 : LOAD_BUCKETS - 1]++;
+    if (ns > *max_ns) *max_ns = ns;
+    (*received)++;
+  }
+} /* drain_tunnel */
+
+
+/*
+ * percentile()
+ * The upper bound, in microseconds, of the histogram bucket holding the
+ * pct'th percentile of count samples.
+ */
+static double percentile(const uint32_t *histogram, uint64_t count,
+                         double pct)
+{
+  uint64_t want = count * pct / 100, seen = 0;
+  int i;
+
+  for (i = 0; i < LOAD_BUCKETS - 1; i++) {
+    seen += histogram[i];
+    if (seen > want) break;
+  }
+  return (i + 1) * (LOAD_BUCKET_NS / 1000.0);
+} /* percentile */
+
+
+/*
+ * load_tunnel()
+ * The tunnel mode: see the top of this file.
+ */
+static void load_tunnel(int udp_port, int out_port, long rate, int secs,
+                        int flows, int size)
+{
+  static unsigned char pkt[65536];
+  static uint32_t histogram[LOAD_BUCKETS];
+  int socks[LOAD_MAX_FLOWS];
+  uint64_t start, end, due, sent = 0, received = 0, max_ns = 0;
+  struct pollfd pfd;
+  struct stamp st;
+  int out, i;
+
+  out = bound_socket(SOCK_DGRAM, out_port);
+  i = LOAD_RCVBUF;
+  if (setsockopt(out, SOL_SOCKET, SO_RCVBUFFORCE, (void *)&i, sizeof(i)) < 0) {
+    setsockopt(out, SOL_SOCKET, SO_RCVBUF, (void *)&i, sizeof(i));
+  }
+  for (i = 0; i < flows; i++) {
+    socks[i] = udp_socket(udp_port);
+  }
+  memset(pkt, 0, size);
+
+  start = now_ns();
+  end = start + (uint64_t)secs * 1000000000;
+  while (now_ns() < end) {
+    due = pace(start, rate, sent);
+    while (sent < due) {
+      st.seq = sent;
+      st.sent_ns = now_ns();
+      memcpy(pkt, &st, sizeof(st));
+      if (send(socks[sent % flows], pkt, size, 0) < 0 &&
+          errno != ECONNREFUSED) {
+        perror("load_tunnel: send");
+        exit(1);
+      }
+      sent++;
+    }
+    drain_tunnel(out, histogram, &received, &max_ns);
+  }
+  end = now_ns();
+
+  pfd.fd = out;
+  pfd.events = POLLIN;
+  while (received < sent && poll(&pfd, 1, LOAD_DRAIN_MS) > 0) {
+    drain_tunnel(out, histogram, &received, &max_ns);
+  }
+
+  printf("sent %llu datagrams in %.2f s (%.0f/s); received %llu, lost "
+         "%.2f%%; latency p50<%.0fus p90<%.0fus p99<%.0fus p99.9<%.0fus "
+         "max=%.0fus\n", (unsigned long long) sent, (end - start) / 1e9,
+         sent * 1e9 / (end - start), (unsigned long long) received,
+         100.0 * (sent - received) / sent,
+         percentile(histogram, received, 50),
+         percentile(histogram, received, 90),
+         percentile(histogram, received, 99),
+         percentile(histogram, received, 99.9), max_ns / 1000.0);
+} /* load_tunnel */
+
+
+/*
+ * write_all()
+ * Write len bytes at buf to the blocking socket sock.  Return non-zero
+ * if it has gone.
+ */
+static int write_all(int sock, const char *buf, ssize_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(sock, buf, len, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+} /* write_all */
+
+
+/*
+ * run_proxy()
+ * The proxy mode: see the top of this file.
+ */
+static void run_proxy(int listen_port, int tcp_port, int permille,
+                      int stall_ms)
+{
+  static char buf[LOAD_CHUNK];
+  struct proxy_conn conns[LOAD_MAX_CONNS];
+  struct pollfd fds[2 * LOAD_MAX_CONNS + 1];
+  int slots[2 * LOAD_MAX_CONNS + 1];
+  int listener, nconns = 0, nfds, timeout, i, sock, up;
+  uint64_t now;
+  ssize_t n;
+
+  listener = bound_socket(SOCK_STREAM, listen_port);
+  if (listen(listener, LOAD_MAX_CONNS) < 0) {
+    perror("run_proxy: listen");
+    exit(1);
+  }
+
+  for (;;) {
+    now = now_ns();
+    timeout = -1;
+    nfds = 0;
+    fds[nfds].fd = listener;
+    fds[nfds++].events = POLLIN;
+    for (i = 0; i < nconns; i++) {
+      if (conns[i].down == -1) continue;
+      if (conns[i].stalled_until <= now) {
+        slots[nfds] = i;
+        fds[nfds].fd = conns[i].down;
+        fds[nfds++].events = POLLIN;
+      }
+      else if (timeout == -1 ||
+               (conns[i].stalled_until - now) / 1000000 + 1 < timeout) {
+        timeout = (conns[i].stalled_until - now) / 1000000 + 1;
+      }
+      slots[nfds] = i;
+      fds[nfds].fd = conns[i].up;
+      fds[nfds++].events = POLLIN;
+    }
+
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR) continue;
+      perror("run_proxy: poll");
+      exit(1);
+    }
+
+    if (fds[0].revents && nconns < LOAD_MAX_CONNS &&
+        (sock = accept(listener, NULL, NULL)) >= 0) {
+      up = tcp_connect(tcp_port);
+      fcntl(up, F_SETFL, 0);
+      conns[nconns].down = sock;
+      conns[nconns].up = up;
+      conns[nconns++].stalled_until = 0;
+    }
+
+    for (i = 1; i < nfds; i++) {
+      struct proxy_conn *c = &conns[slots[i]];
+
+      if (fds[i].revents == 0 || c->down == -1) continue;
+      sock = fds[i].fd;
+      n = recv(sock, buf, sizeof(buf), 0);
+      if (n <= 0 ||
+          write_all(sock == c->down ? c->up : c->down, buf, n)) {
+        close(c->down);
+        close(c->up);
+        c->down = c->up = -1;
+        continue;
+      }
+      if (sock == c->down && random() % 1000 < permille) {
+        c->stalled_until = now_ns() + (uint64_t)stall_ms * 1000000;
+      }
+    }
+  }
+} /* run_proxy */
+
+
+int main(int argc, char *argv[])
+{
+  int udp_port = 0, tcp_port = 0, out_port = 0, listen_port = 0;
+  int secs = 10, flows = 64, size = 100, permille = 10, stall_ms = 20, c;
+  long rate = 1000;
+  pid_t stats_pid = 0;
+  char *mode;
+
+  if (argc < 2) usage(argv[0]);
+  mode = argv[1];
+  optind = 2;
+  while ((c = getopt(argc, argv, "u:t:o:l:r:d:k:f:s:p:w:")) != -1) {
+    switch (c) {
+    case 'u':
+      udp_port = atoi(optarg);
+      break;
+    case 't':
+      tcp_port = atoi(optarg);
+      break;
+    case 'o':
+      out_port = atoi(optarg);
+      break;
+    case 'l':
+      listen_port = atoi(optarg);
+      break;
+    case 'r':
+      rate = atol(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    case 'k':
+      stats_pid = atoi(optarg);
+      break;
+    case 'f':
+      flows = atoi(optarg);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    case 'p':
+      permille = atoi(optarg);
+      break;
+    case 'w':
+      stall_ms = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (rate <= 0 || secs <= 0) {
+    usage(argv[0]);
+  }
+
+  if (strcmp(mode, "wir") == 0) {
+    if (udp_port <= 0 || tcp_port <= 0 ||
+        optind >= argc || argc - optind > LOAD_MAX_DEVICES) usage(argv[0]);
+    for (c = optind; c < argc; c++) {
+      if (strlen(argv[c]) != LOAD_IMEI_LEN) usage(argv[0]);
+    }
+    load_wir(udp_port, tcp_port, rate, secs, stats_pid, argv + optind, argc - optind);
+  }
+  else if (strcmp(mode, "tunnel") == 0) {
+    if (udp_port <= 0 || out_port <= 0 || flows <= 0 ||
+        flows > LOAD_MAX_FLOWS || size < (int) sizeof(struct stamp) ||
+        size > 65000) usage(argv[0]);
+    load_tunnel(udp_port, out_port, rate, secs, flows, size);
+  }
+  else if (strcmp(mode, "proxy") == 0) {
+    if (listen_port <= 0 || tcp_port <= 0 || permille < 0 || stall_ms < 0) {
+      usage(argv[0]);
+    }
+    run_proxy(listen_port, tcp_port, permille, stall_ms);
+  }
+  else {
+    usage(argv[0]);
+  }
+  return 0;
+} /* main */
@@ -2,6 +2,8 @@
  * the specified port, then send the UDP packets (with a length header) over
  * the TCP connection */
 
+#define _GNU_SOURCE   /* sched_setaffinity() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,19 +12,51 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <time.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(SO_TIMESTAMPING)
+#include <linux/net_tstamp.h>
+#define HAVE_RX_TIMESTAMPS 1
+#endif
 
 #include "wirvars.h"
 #include "host2ip.h"
+#include "admit.h"
+#include "resolver.h"
+#include "latency.h"
+#include "devconn.h"
+#include "handoff.h"
+#include "zlink.h"
+#include "flow.h"
+#include "wirbin.h"
+#include "devstate.h"
 
 #define UDPBUFFERSIZE 65536
 #define TCPBUFFERSIZE (UDPBUFFERSIZE + 2) /* UDP packet + 2 (length field) */
+#define OUTBUFFERSIZE 65536 /* pending output records */
+#define WIRLINESIZE 256     /* one formatted WIR record */
+#define CACHELINESIZE 64
+#define BUSY_POLL_USEC 50   /* SO_BUSY_POLL budget in low-latency mode */
+#define CMSGBUFFERSIZE 256  /* ancillary data on received datagrams */
+#define OUTTRACESLOTS 1024  /* traced records per output batch */
+#define OUTRECORDSLOTS (OUTBUFFERSIZE / 2)  /* records are 2 bytes or more */
+#define HANDOFF_TIMEOUT 5   /* seconds to wait on a successor */
+#define TUNNELHEADROOM 16   /* free bytes before a received datagram */
+#define MAXSTRIPES 64       /* TCP connections per relay */
 
 #define SET_MAX(fd) do { if (max < (fd) + 1) { max = (fd) + 1; } } while (0)
+#define POLL_READY(fds, slot) \
+  ((slot) != -1 && ((fds)[slot].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)))
 
 #if (SIZEOF_SHORT == 2)
 typedef unsigned short u_int16;
@@ -32,6 +66,15 @@ typedef unsigned short u_int16;
 
 typedef unsigned char u_int8;
 
+/* Latency stamps of a record waiting in a relay's output batch. */
+struct pending_trace {
+  uint64_t rx_time;     /* kernel receive time, ns since epoch; 0 if none */
+  uint64_t formatted;   /* monotonic ns when the record was formatted */
+  uint32_t recv, parse, format;
+  uint16_t length, device;
+  int sampled;          /* write to the trace file */
+};
+
 struct out_packet {
   u_int16 length;
   unsigned char buf[UDPBUFFERSIZE];
@@ -48,14 +91,188 @@ struct relay {
   int tcp_listen_sock;
   int tcp_sock;
 
+  /* Client mode: the TCP peer is looked up by name on every (re)connect. */
+  char *tcp_host;
+  struct sockaddr_storage tcp_peer;
+  socklen_t tcp_peer_len;
+  enum {tcp_connected = 0, tcp_resolving, tcp_connecting, tcp_waiting} tcp_state;
+  time_t retry_at;
+
   char buf[TCPBUFFERSIZE];
   char *buf_ptr, *packet_start;
   int packet_length;
+  int packet_flow;      /* --flows: the flow ID of the frame being read */
+  int stripe;           /* --stripes: our index among the relay's stripes */
   enum {uninitialized = 0, reading_length, reading_packet} state;
+
+  char out_buf[OUTBUFFERSIZE];
+  int out_len, out_records;
+  uint16_t out_starts[OUTRECORDSLOTS];  /* offset of each pending record */
+  int timer_fd;         /* -1 if there is no flush deadline */
+  int timer_armed;
+  unsigned long out_dropped;  /* records lost while disconnected */
+  struct pending_trace *out_trace;  /* per pending record, if tracing */
+  struct zlink *zlink;  /* --compress state, NULL if off */
+  struct flow_table *flows;  /* --flows state, NULL if off */
+
+  /* Datagrams dropped by the kernel on udp_recv_sock (SO_RXQ_OVFL). */
+  uint32_t kernel_drops;
+  uint32_t kernel_drops_reported;
+  time_t drops_reported_at;
+  time_t sockbuf_grown_at;
+};
+
+/* A relay's session state as passed to a successor (see serve_handoff()),
+ * along with its sockets: udp_recv_sock, udp_send_sock, tcp_listen_sock in
+ * server mode, and tcp_sock if connected.  buf and out_buf follow as
+ * separate messages, if not empty, and then out_starts for out_records. */
+struct relay_snapshot {
+  int32_t connected;
+  int32_t state;
+  int32_t buf_len, packet_start, packet_length;
+  int32_t out_len, out_records;
+  uint32_t kernel_drops;
+  uint64_t out_dropped;
+};
+
+/* A device's UDP registration, passed by IMEI in case the successor's
+ * device list differs. */
+struct registration_snapshot {
+  uint64_t imei, port;
 };
 
 static int debug = 0;
 
+/* Registered device for each UDP source port, as index + 1 (0 = none). */
+#if deviceCount >= 65535
+#error "port_device cannot hold a device index this large"
+#endif
+static u_int16 port_device[65536];
+
+static volatile sig_atomic_t stats_requested = 0;
+
+/* Hot-path buffers, allocated once and cache-line aligned, instead of
+ * 64 KB of stack touched on every udp_to_tcp() call. */
+static unsigned char *udp_rx_buf;
+static unsigned char *tcp_rx_buf;
+static char *wir_line_buf;
+
+/* Tunnel mode: relay UDP packets as they are, length-prefixed, instead of
+ * decoding Codec8 to WIR. */
+static int tunnel_mode = 0;
+
+/* Compression level for the TCP connections (see zlink.h), or -1 for
+ * none. */
+static int compress_level = -1;
+
+/* Tunnel mode with flow IDs: flows per relay and side (0: off), and how
+ * many seconds a flow may be idle before it is forgotten. */
+static int flow_max = 0;
+static int flow_idle = 120;
+
+/* Tunnel mode: TCP connections per relay, frames being spread over them
+ * by flow.  Each is a struct relay of its own, following the first one,
+ * whose UDP sockets and flow table the others share. */
+static int stripe_count = 1;
+
+/* How decoded Codec8 records are written to the TCP connection. */
+enum { OUTPUT_WIR, OUTPUT_BINARY };
+static int output_format = OUTPUT_WIR;
+
+/* Unix socket on which to answer queries about the last known state of
+ * each device (see devstate.h), or NULL for none. */
+static char *state_path = NULL;
+
+/* Low-latency mode: the CPU to pin the I/O loop to, or -1 if off. */
+static int low_latency_cpu = -1;
+
+/* TCP port on which to accept Codec8 devices (0: none), and the relay
+ * whose WIR output their records go to. */
+static int device_port = 0;
+static struct relay *device_relay;
+
+/* Seconds a device connection may stay silent before we close it (0:
+ * forever). */
+static int device_idle = 0;
+
+/* Latency tracing: stamp each packet through its stages, and write every
+ * trace_sample'th stamped packet to the trace file (0: none). */
+static int latency_stats = 0;
+static int trace_sample = 0;
+static unsigned long trace_counter = 0;
+
+/* Socket buffers are doubled, up to this many bytes, whenever the kernel
+ * reports dropped datagrams.  0 leaves them at the system default. */
+static int max_sockbuf = 4 * 1024 * 1024;
+
+/* Output batching policy: flush pending records to TCP once this many
+ * bytes or records are pending, or once the oldest is this old.  Zero
+ * disables a limit; the default flushes every record immediately. */
+static int flush_bytes = 0;
+static int flush_records = 1;
+static long flush_usec = 0;
+
+/* Client mode: seconds to wait before reconnecting a lost TCP connection
+ * (0: exit instead), and how long name lookups are cached. */
+static int reconnect_delay = 0;
+static int dns_ttl = 60;
+
+/* Hot restart: the Unix socket on which we hand our sockets to a
+ * successor, and on which we look for a predecessor at startup. */
+static char *handoff_path = NULL;
+static int handoff_listen_sock = -1;
+
+enum {
+  OPT_SRC_RATE = 256,
+  OPT_DEV_RATE,
+  OPT_FLUSH_BYTES,
+  OPT_FLUSH_RECORDS,
+  OPT_FLUSH_USEC,
+  OPT_RECONNECT,
+  OPT_DNS_TTL,
+  OPT_LOW_LATENCY,
+  OPT_MAX_SOCKBUF,
+  OPT_LATENCY_STATS,
+  OPT_TRACE_FILE,
+  OPT_TRACE_SAMPLE,
+  OPT_DEVICE_PORT,
+  OPT_HANDOFF,
+  OPT_TUNNEL,
+  OPT_COMPRESS,
+  OPT_FLOWS,
+  OPT_FLOW_IDLE,
+  OPT_STRIPES,
+  OPT_FORMAT,
+  OPT_STATE_SOCKET,
+  OPT_DEVICE_IDLE
+};
+
+static const struct option long_options[] = {
+  {"src-rate", required_argument, NULL, OPT_SRC_RATE},
+  {"dev-rate", required_argument, NULL, OPT_DEV_RATE},
+  {"flush-bytes", required_argument, NULL, OPT_FLUSH_BYTES},
+  {"flush-records", required_argument, NULL, OPT_FLUSH_RECORDS},
+  {"flush-usec", required_argument, NULL, OPT_FLUSH_USEC},
+  {"reconnect", required_argument, NULL, OPT_RECONNECT},
+  {"dns-ttl", required_argument, NULL, OPT_DNS_TTL},
+  {"low-latency", required_argument, NULL, OPT_LOW_LATENCY},
+  {"max-sockbuf", required_argument, NULL, OPT_MAX_SOCKBUF},
+  {"latency-stats", no_argument, NULL, OPT_LATENCY_STATS},
+  {"trace-file", required_argument, NULL, OPT_TRACE_FILE},
+  {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+  {"device-port", required_argument, NULL, OPT_DEVICE_PORT},
+  {"handoff", required_argument, NULL, OPT_HANDOFF},
+  {"tunnel", no_argument, NULL, OPT_TUNNEL},
+  {"compress", required_argument, NULL, OPT_COMPRESS},
+  {"flows", required_argument, NULL, OPT_FLOWS},
+  {"flow-idle", required_argument, NULL, OPT_FLOW_IDLE},
+  {"stripes", required_argument, NULL, OPT_STRIPES},
+  {"format", required_argument, NULL, OPT_FORMAT},
+  {"state-socket", required_argument, NULL, OPT_STATE_SOCKET},
+  {"device-idle", required_argument, NULL, OPT_DEVICE_IDLE},
+  {NULL, 0, NULL, 0}
+};
+
 /*
  * usage()
  * Print the program usage info, and exit.
@@ -70,6 +287,32 @@ static void usage(char *progname) {
   fprintf(stderr, "     -r: RTP mode.  Connect/listen on ports N and N+1 for both UDP and TCP.\n");
   fprintf(stderr, "         Port numbers must be even.\n");
   fprintf(stderr, "     -v: Verbose mode.  Specify -v multiple times for increased verbosity.\n");
+  fprintf(stderr, "     --src-rate=PPS[/BURST]: Drop UDP packets from a source address above this rate.\n");
+  fprintf(stderr, "     --dev-rate=PPS[/BURST]: Drop UDP packets from a registered device above this rate.\n");
+  fprintf(stderr, "     --flush-bytes=B, --flush-records=N, --flush-usec=T: Batch TCP output until\n");
+  fprintf(stderr, "         B bytes or N records are pending, or the oldest is T microseconds old.\n");
+  fprintf(stderr, "     --reconnect=SECS: Client mode.  Re-resolve and reconnect SECS after losing TCP.\n");
+  fprintf(stderr, "     --dns-ttl=SECS: Cache TCP host name lookups for SECS seconds (default 60).\n");
+  fprintf(stderr, "     --low-latency=CPU: Pin to CPU and busy-poll instead of sleeping.\n");
+  fprintf(stderr, "     --max-sockbuf=BYTES: Grow socket buffers up to BYTES on kernel drops (default 4M).\n");
+  fprintf(stderr, "     --latency-stats: Keep per-stage latency histograms, printed on SIGUSR1.\n");
+  fprintf(stderr, "     --trace-file=PATH, --trace-sample=N: Also write every Nth packet's stage\n");
+  fprintf(stderr, "         latencies to PATH (default N 1000).\n");
+  fprintf(stderr, "     --device-port=PORT: Also accept Codec8 devices over TCP on PORT.\n");
+  fprintf(stderr, "     --device-idle=SECS: Close device connections silent for SECS seconds.\n");
+  fprintf(stderr, "     --handoff=PATH: Hot restart.  Take over the sockets of the udptunnel\n");
+  fprintf(stderr, "         listening on Unix socket PATH, if any; then listen there ourselves.\n");
+  fprintf(stderr, "     --tunnel: Relay UDP packets as they are instead of decoding them to WIR.\n");
+  fprintf(stderr, "     --compress=LEVEL: Deflate TCP output at LEVEL (0-9; 0 accepts compressed\n");
+  fprintf(stderr, "         input only).  The peer must use --compress too.\n");
+  fprintf(stderr, "     --flows=MAX: Tunnel mode.  Keep up to MAX UDP peers apart by flow ID;\n");
+  fprintf(stderr, "         the peer must use --flows too.\n");
+  fprintf(stderr, "     --flow-idle=SECS: Forget flows idle for SECS seconds (default 120).\n");
+  fprintf(stderr, "     --stripes=K: Tunnel mode.  Spread frames over K TCP connections by flow.\n");
+  fprintf(stderr, "     --format=FMT: Write decoded records as wir lines (default) or as\n");
+  fprintf(stderr, "         compact binary records (see wirbin.h).\n");
+  fprintf(stderr, "     --state-socket=PATH: Answer queries for each device's last known state\n");
+  fprintf(stderr, "         on Unix socket PATH (see devstate.h).\n");
   exit(2);
 } /* usage */
 
@@ -84,6 +327,7 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
 {
   int c;
   char *tcphostname, *tcpportstr, *udphostname, *udpportstr, *udpttlstr;
+  char *p;
   struct in_addr tcpaddr, udpaddr;
   int tcpport, udpport, udpttl;
   int i;
@@ -96,7 +340,7 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
   tcphostname = NULL;
   tcpportstr = NULL;
 
-  while ((c = getopt(argc, argv, "s:c:rvh")) != EOF) {
+  while ((c = getopt_long(argc, argv, "s:c:rvh", long_options, NULL)) != EOF) {
     switch (c) {
     case 's':
       if (*is_server != -1) {
@@ -122,6 +366,168 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
     case 'v':
       debug++;
       break;
+    case OPT_SRC_RATE:
+      if (admit_parse_limit(optarg, &admit_src_limit)) {
+        fprintf(stderr, "%s: invalid rate\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_DEV_RATE:
+      if (admit_parse_limit(optarg, &admit_dev_limit)) {
+        fprintf(stderr, "%s: invalid rate\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FLUSH_BYTES:
+      errno = 0;
+      flush_bytes = strtol(optarg, NULL, 0);
+      if (errno || flush_bytes < 0 || flush_bytes > OUTBUFFERSIZE) {
+        fprintf(stderr, "%s: invalid byte count\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FLUSH_RECORDS:
+      errno = 0;
+      flush_records = strtol(optarg, NULL, 0);
+      if (errno || flush_records < 0) {
+        fprintf(stderr, "%s: invalid record count\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FLUSH_USEC:
+      errno = 0;
+      flush_usec = strtol(optarg, NULL, 0);
+      if (errno || flush_usec < 0) {
+        fprintf(stderr, "%s: invalid interval\n", optarg);
+        exit(2);
+      }
+#ifndef HAVE_SYS_TIMERFD_H
+      if (flush_usec != 0) {
+        fprintf(stderr, "%s: --flush-usec is not supported on this platform\n",
+                argv[0]);
+        exit(2);
+      }
+#endif
+      break;
+    case OPT_RECONNECT:
+      errno = 0;
+      reconnect_delay = strtol(optarg, NULL, 0);
+      if (errno || reconnect_delay < 0) {
+        fprintf(stderr, "%s: invalid interval\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_DNS_TTL:
+      errno = 0;
+      dns_ttl = strtol(optarg, NULL, 0);
+      if (errno || dns_ttl < 1) {
+        fprintf(stderr, "%s: invalid TTL\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_LOW_LATENCY:
+      errno = 0;
+      low_latency_cpu = strtol(optarg, NULL, 0);
+      if (errno || low_latency_cpu < 0 || low_latency_cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "%s: invalid CPU number\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_MAX_SOCKBUF:
+      errno = 0;
+      max_sockbuf = strtol(optarg, NULL, 0);
+      if (errno || max_sockbuf < 0) {
+        fprintf(stderr, "%s: invalid buffer size\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_LATENCY_STATS:
+      latency_stats = 1;
+      break;
+    case OPT_TRACE_FILE:
+      latency_stats = 1;
+      if (trace_sample == 0) {
+        trace_sample = 1000;
+      }
+      latency_open_trace(optarg);
+      break;
+    case OPT_TRACE_SAMPLE:
+      errno = 0;
+      trace_sample = strtol(optarg, NULL, 0);
+      if (errno || trace_sample <= 0) {
+        fprintf(stderr, "%s: invalid sampling interval\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_DEVICE_PORT:
+      errno = 0;
+      device_port = strtol(optarg, NULL, 0);
+      if (errno || device_port <= 0 || device_port >= 65536) {
+        fprintf(stderr, "%s: invalid port number\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_HANDOFF:
+      handoff_path = optarg;
+      break;
+    case OPT_TUNNEL:
+      tunnel_mode = 1;
+      break;
+    case OPT_COMPRESS:
+      errno = 0;
+      compress_level = strtol(optarg, NULL, 0);
+      if (errno || compress_level < 0 || compress_level > 9) {
+        fprintf(stderr, "%s: invalid compression level\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FLOWS:
+      errno = 0;
+      flow_max = strtol(optarg, NULL, 0);
+      if (errno || flow_max <= 0 || flow_max > FLOW_MAX) {
+        fprintf(stderr, "%s: invalid flow count\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FLOW_IDLE:
+      errno = 0;
+      flow_idle = strtol(optarg, NULL, 0);
+      if (errno || flow_idle <= 0) {
+        fprintf(stderr, "%s: invalid interval\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_STRIPES:
+      errno = 0;
+      stripe_count = strtol(optarg, NULL, 0);
+      if (errno || stripe_count <= 0 || stripe_count > MAXSTRIPES) {
+        fprintf(stderr, "%s: invalid connection count\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_FORMAT:
+      if (strcmp(optarg, "wir") == 0) {
+        output_format = OUTPUT_WIR;
+      }
+      else if (strcmp(optarg, "binary") == 0) {
+        output_format = OUTPUT_BINARY;
+      }
+      else {
+        fprintf(stderr, "%s: unknown output format\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_STATE_SOCKET:
+      state_path = optarg;
+      break;
+    case OPT_DEVICE_IDLE:
+      errno = 0;
+      device_idle = strtol(optarg, NULL, 0);
+      if (errno || device_idle < 0) {
+        fprintf(stderr, "%s: invalid interval\n", optarg);
+        exit(2);
+      }
+      break;
     case 'h':
     case '?':
     default:
@@ -136,6 +542,40 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
     exit(2);
   }
 
+  if (flush_bytes == 0 && flush_records == 0 && flush_usec == 0) {
+    fprintf(stderr, "%s: At least one flush limit must be non-zero.\n",
+            argv[0]);
+    exit(2);
+  }
+
+  /* Compression streams and flow sockets cannot be handed over. */
+  if (handoff_path != NULL && (compress_level != -1 || flow_max != 0)) {
+    fprintf(stderr, "%s: --handoff cannot be used with --compress or "
+            "--flows.\n", argv[0]);
+    exit(2);
+  }
+
+  if (flow_max != 0 && !tunnel_mode) {
+    fprintf(stderr, "%s: --flows needs --tunnel.\n", argv[0]);
+    exit(2);
+  }
+
+  if (stripe_count > 1 && !tunnel_mode) {
+    fprintf(stderr, "%s: --stripes needs --tunnel.\n", argv[0]);
+    exit(2);
+  }
+
+  if (output_format != OUTPUT_WIR && tunnel_mode) {
+    fprintf(stderr, "%s: --format cannot be used with --tunnel.\n", argv[0]);
+    exit(2);
+  }
+
+  if (state_path != NULL && tunnel_mode) {
+    fprintf(stderr, "%s: --state-socket cannot be used with --tunnel.\n",
+            argv[0]);
+    exit(2);
+  }
+
   if (argc <= optind) {
     usage(argv[0]);
   }
@@ -148,8 +588,16 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
   udpttlstr = strtok(NULL, ":/ ");
 
   if (!*is_server) {
-    tcphostname = strtok(tcphostname, ":/ ");
-    tcpportstr = strtok(NULL, ":/ ");
+    /* An IPv6 address has to be bracketed: [2001:db8::1]/port */
+    if (tcphostname[0] == '[' && (p = strchr(tcphostname, ']')) != NULL) {
+      *p = '\0';
+      tcphostname++;
+      tcpportstr = strtok(p + 1, ":/ ");
+    }
+    else {
+      tcphostname = strtok(tcphostname, ":/ ");
+      tcpportstr = strtok(NULL, ":/ ");
+    }
   }
   else {
     tcphostname = NULL;
@@ -197,17 +645,12 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
     exit(2);
   }
 
-  if (*is_server) {
-    tcpaddr.s_addr = INADDR_ANY;
-  }
-  else {
-    tcpaddr = host2ip(tcphostname);
-    if (tcpaddr.s_addr == INADDR_ANY) {
-      fprintf(stderr, "%s: TCP host unknown\n", tcphostname);
-      exit(2);
-    }
-  }
+  /* In client mode the TCP host is resolved asynchronously, by
+   * start_tcp_client(). */
+  tcpaddr.s_addr = INADDR_ANY;
    
+  /* Each relay's stripes follow it. */
+  *relay_count *= stripe_count;
   *relays = (struct relay *) calloc(*relay_count, sizeof(struct relay));
   if (relays == NULL) {
     perror("Error allocating relay structure");
@@ -215,19 +658,78 @@ static void parse_args(int argc, char *argv[], struct relay **relays,
   }
 
   for (i = 0; i < *relay_count; i++) {
+    (*relays)[i].stripe = i % stripe_count;
     (*relays)[i].udpaddr.sin_addr = udpaddr;
-    (*relays)[i].udpaddr.sin_port = htons(udpport + i);
+    (*relays)[i].udpaddr.sin_port = htons(udpport + i / stripe_count);
     (*relays)[i].udpaddr.sin_family = AF_INET;
     (*relays)[i].udp_ttl = udpttl;
     (*relays)[i].multicast_udp = IN_MULTICAST(htons(udpaddr.s_addr));
 
     (*relays)[i].tcpaddr.sin_addr = tcpaddr;
-    (*relays)[i].tcpaddr.sin_port = htons(tcpport + i);
+    (*relays)[i].tcpaddr.sin_port = htons(tcpport + i / stripe_count);
     (*relays)[i].tcpaddr.sin_family = AF_INET;
+    (*relays)[i].tcp_host = tcphostname;
+    (*relays)[i].tcp_sock = -1;
+
+    (*relays)[i].timer_fd = -1;
+    if (compress_level != -1) {
+      (*relays)[i].zlink = zlink_new(compress_level);
+    }
+    if (flow_max != 0) {
+      (*relays)[i].flows = (*relays)[i].stripe != 0 ? (*relays)[i - 1].flows :
+                           flow_table_new(flow_max, &(*relays)[i]);
+    }
   }
+
+  device_relay = &(*relays)[0];
 } /* parse_args */
 
 
+/* setup_udp_recv_options()
+ * Set the options of the relay's UDP receiving socket that depend on our
+ * command line; done afresh on a socket taken over from a predecessor.
+ * Exit if anything goes wrong.
+ */
+static void setup_udp_recv_options(struct relay *relay)
+{
+  int opt;
+
+#ifdef SO_RXQ_OVFL
+  /* Have the kernel tell us, with each datagram, how many it has had to
+   * drop because we were not reading fast enough. */
+  opt = 1;
+  if (setsockopt(relay->udp_recv_sock, SOL_SOCKET, SO_RXQ_OVFL,
+                 (void *)&opt, sizeof(opt)) < 0) {
+    perror("setup_udp_recv: setsockopt(SO_RXQ_OVFL)");
+    exit(1);
+  }
+#endif
+
+#ifdef HAVE_RX_TIMESTAMPS
+  if (latency_stats) {
+    opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(relay->udp_recv_sock, SOL_SOCKET, SO_TIMESTAMPING,
+                   (void *)&opt, sizeof(opt)) < 0) {
+      perror("setup_udp_recv: setsockopt(SO_TIMESTAMPING)");
+      exit(1);
+    }
+  }
+#endif
+
+#ifdef SO_BUSY_POLL
+  if (low_latency_cpu != -1) {
+    /* Not fatal: raising this above net.core.busy_read needs
+     * CAP_NET_ADMIN, and the main loop spins regardless. */
+    opt = BUSY_POLL_USEC;
+    if (setsockopt(relay->udp_recv_sock, SOL_SOCKET, SO_BUSY_POLL,
+                   (void *)&opt, sizeof(opt)) < 0) {
+      perror("setup_udp_recv: setsockopt(SO_BUSY_POLL)");
+    }
+  }
+#endif
+} /* setup_udp_recv_options */
+
+
 /* setup_udp_recv()
  * Set up the UDP receiving socket for the specified relay.
  * Exit if anything goes wrong.
@@ -291,7 +793,7 @@ static void setup_udp_recv(struct relay *relay)
     exit(1);
   }
 
-  return;
+  setup_udp_recv_options(relay);
 } /* setup_udp_recv */
 
 
@@ -376,7 +878,7 @@ static void setup_server_listen(struct relay *relay)
     exit(1);
   }
     
-  if (listen(relay->tcp_listen_sock, 1) < 0) {
+  if (listen(relay->tcp_listen_sock, stripe_count) < 0) {
     perror("setup_server_listen: listen");
     exit(1);
   }
@@ -389,6 +891,48 @@ static void setup_server_listen(struct relay *relay)
 } /* setup_server_listen */
 
 
+/* setup_stripe()
+ * Set up a relay that is a further stripe of the one before it, sharing
+ * its UDP sockets and (in server mode) its TCP listener.
+ */
+static void setup_stripe(struct relay *relay)
+{
+  struct relay *first = relay - relay->stripe;
+
+  relay->udp_recv_sock = first->udp_recv_sock;
+  relay->udp_send_sock = first->udp_send_sock;
+  relay->tcp_listen_sock = first->tcp_listen_sock;
+  relay->tcp_sock = -1;
+} /* setup_stripe */
+
+
+/* start_link()
+ * The relay's TCP connection is up.  With --compress, start fresh streams
+ * and send our header.  If that fails, return non-zero.
+ */
+static int start_link(struct relay *relay)
+{
+  unsigned char header[ZLINK_HEADER_LEN];
+  int len = 0, n;
+
+  if (relay->zlink == NULL) {
+    return 0;
+  }
+
+  zlink_reset(relay->zlink, header);
+  while (len < ZLINK_HEADER_LEN) {
+    if ((n = send(relay->tcp_sock, header + len, ZLINK_HEADER_LEN - len,
+                  0)) < 0) {
+      if (errno == EINTR) continue;
+      perror("start_link: send");
+      return 1;
+    }
+    len += n;
+  }
+  return 0;
+} /* start_link */
+
+
 /* await_incoming_connections()
  * Wait for connections to be established to all the TCP listeners.
  * Fill in the tcp_sock element of each relay.
@@ -420,10 +964,14 @@ static void await_incoming_connections(struct relay *relays, int relay_count)
         perror("await_incoming_connection: select");
         exit(1);
       }
+      continue;
     }
     
     for (i = 0; i < relay_count; i++) {
-      if (FD_ISSET(relays[i].tcp_listen_sock, &readfds)) {
+      /* Stripes share a listener; each takes one connection from it. */
+      if (relays[i].tcp_sock == -1 &&
+          FD_ISSET(relays[i].tcp_listen_sock, &readfds)) {
+        FD_CLR(relays[i].tcp_listen_sock, &readfds);
         struct sockaddr_in client_addr;
         int addrlen = sizeof(client_addr);
         
@@ -433,6 +981,9 @@ static void await_incoming_connections(struct relay *relays, int relay_count)
           perror("await_incoming_connections: accept");
           exit(1);
         }
+        if (start_link(&relays[i])) {
+          exit(1);
+        }
         
         if (debug) {
           fprintf(stderr, "TCP connection from %s/%hu\n",
@@ -446,137 +997,699 @@ static void await_incoming_connections(struct relay *relays, int relay_count)
 } /* await_incoming_connections */
 
 
-/* setup_tcp_client()
- * Connect the given relay to the desired address.  Fill in the tcp_sock
- * element of the relay structure.
- * Exit on failure.
+/* now_sec()
+ * Seconds on the monotonic clock.
+ */
+static time_t now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+} /* now_sec */
+
+
+/* tcp_client_failed()
+ * The relay's TCP connection could not be made, or has been lost.  In
+ * client mode with --reconnect, schedule another attempt and return 0;
+ * otherwise return non-zero so that we bail out.
+ */
+static int tcp_client_failed(struct relay *relay)
+{
+  if (relay->tcp_sock != -1) {
+    close(relay->tcp_sock);
+    relay->tcp_sock = -1;
+  }
+
+  if (relay->tcp_host == NULL || reconnect_delay == 0) {
+    return 1;
+  }
+
+  /* Try the peer's next address, or look it up afresh if there is none:
+   * it may have moved. */
+  resolver_forget(relay->tcp_host);
+  relay->tcp_state = tcp_waiting;
+  relay->retry_at = now_sec() + reconnect_delay;
+
+  if (debug) fprintf(stderr, "Reconnecting to %s in %d seconds\n",
+                     relay->tcp_host, reconnect_delay);
+  return 0;
+} /* tcp_client_failed */
+
+
+/* start_tcp_client()
+ * Begin connecting the given relay to its TCP peer.  The peer's name is
+ * looked up through the resolver; if the answer is not cached yet, we are
+ * called again once it is.  The connect itself is non-blocking and is
+ * completed by finish_tcp_client().
+ * Exit on failure, unless reconnecting.
  */
-static void setup_tcp_client(struct relay *relay)
+static void start_tcp_client(struct relay *relay)
 {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  switch (resolver_lookup(relay->tcp_host, &addr, &addrlen)) {
+  case RESOLVE_PENDING:
+    relay->tcp_state = tcp_resolving;
+    return;
+  case RESOLVE_FAILED:
+    fprintf(stderr, "%s: TCP host unknown\n", relay->tcp_host);
+    if (tcp_client_failed(relay)) {
+      exit(2);
+    }
+    return;
+  case RESOLVE_OK:
+    break;
+  }
+
+  if (addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)&addr)->sin6_port = relay->tcpaddr.sin_port;
+  }
+  else {
+    ((struct sockaddr_in *)&addr)->sin_port = relay->tcpaddr.sin_port;
+  }
+  memcpy(&relay->tcp_peer, &addr, addrlen);
+  relay->tcp_peer_len = addrlen;
+
   /* Create TCP socket. */
-  if ((relay->tcp_sock = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((relay->tcp_sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) {
     perror("setup_tcp_client: socket");
     exit(1);
   }
 
-  if (connect(relay->tcp_sock, (struct sockaddr *) &(relay->tcpaddr),
-              sizeof(relay->tcpaddr)) < 0) {
-    perror("setup_tcp_client: connect");
+  if (fcntl(relay->tcp_sock, F_SETFL, O_NONBLOCK) < 0) {
+    perror("setup_tcp_client: fcntl");
     exit(1);
   }
 
-  if (debug) fprintf(stderr, "Connected TCP to %s/%hu\n",
-                     inet_ntoa(relay->tcpaddr.sin_addr),
-                     ntohs(relay->tcpaddr.sin_port));
-} /* connect_tcp */
+  if (connect(relay->tcp_sock, (struct sockaddr *) &addr, addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    perror("setup_tcp_client: connect");
+    if (tcp_client_failed(relay)) {
+      exit(1);
+    }
+    return;
+  }
 
-/***************************** Telt - Wir Custom Code  v1.0 ******************************************/
+  relay->tcp_state = tcp_connecting;
+} /* start_tcp_client */
 
-/* udp_to_tcp()
- * A packet has arrived on the UDP port of the relay.  Forward it to the TCP
- * port.  If we need to bail out, return non-zero.
+
+/* finish_tcp_client()
+ * The relay's pending TCP connect has completed, one way or the other.
+ * Exit on failure, unless reconnecting.
  */
-static int udp_to_tcp(struct relay *relay)
+static void finish_tcp_client(struct relay *relay)
 {
-  struct out_packet p;
-  int buflen;
-  struct sockaddr_in remote_udpaddr;
-  int addrlen = sizeof(remote_udpaddr);
+  int err;
+  socklen_t len = sizeof(err);
+  char host[NI_MAXHOST];
 
-  //////////// Custom Variables /////////////////
-  uint64_t imei; 
-  struct atrack_wir_message wirMessage = {};
-  struct out_packet sendPacket;
-  struct tm * ptm;
-	time_t epch;
-	float floatTemp;
-	float floatLat =0;
-	float floatLon =0;
-	int8_t wirCount=0;
-  uint16_t scanPointer;
-  uint8_t twoByteIOCount;
-  /////////////////////////////
+  if (getsockopt(relay->tcp_sock, SOL_SOCKET, SO_ERROR,
+                 (void *)&err, &len) < 0) {
+    err = errno;
+  }
+  if (err != 0) {
+    errno = err;
+    perror("setup_tcp_client: connect");
+    if (tcp_client_failed(relay)) {
+      exit(1);
+    }
+    return;
+  }
 
-  if ((buflen = recvfrom(relay->udp_recv_sock, p.buf, UDPBUFFERSIZE, 0,
-                         (struct sockaddr *) &remote_udpaddr,
-                         &addrlen)) <= 0) {
-    if (buflen < 0) {
-      perror("udp_to_tcp: recv");
+  if (fcntl(relay->tcp_sock, F_SETFL, 0) < 0) {
+    perror("setup_tcp_client: fcntl");
+    exit(1);
+  }
+
+  relay->tcp_state = tcp_connected;
+  relay->state = uninitialized;
+  if (start_link(relay)) {
+    if (tcp_client_failed(relay)) {
+      exit(1);
     }
-    return 1;
+    return;
   }
 
-  if (debug > 1) {
-    fprintf(stderr, "\nReceived %d byte UDP packet from %s/%hu\n", buflen,
-            inet_ntoa(remote_udpaddr.sin_addr),
-            ntohs(remote_udpaddr.sin_port));
-    /* Print the buffer */      
-    for(int i = 0; i<buflen ; i++){
-      fprintf(stderr, "%02X ",p.buf[i]); 
+  if (debug) {
+    if (getnameinfo((struct sockaddr *) &relay->tcp_peer, relay->tcp_peer_len,
+                    host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+      strcpy(host, "?");
     }
-    fprintf(stderr, "\n");
-    /* End Of Print the buffer */ 
+    fprintf(stderr, "Connected TCP to %s/%hu\n", host,
+            ntohs(relay->tcpaddr.sin_port));
   }
+} /* finish_tcp_client */
 
-  if(buflen== 17 && p.buf[0]== 0x00 && p.buf[1]== 0x0F){ // Imei Registration to Server
-    imei = 0;
-    for(int i = 2; i<buflen ; i++){
-      imei *= 10;
-      imei += (p.buf[i]-0x30);
+/* setup_buffers()
+ * Allocate the hot-path buffers.  Exit if anything goes wrong.
+ */
+static void setup_buffers(void)
+{
+  void *ptr;
+
+  if (posix_memalign(&ptr, CACHELINESIZE,
+                     TUNNELHEADROOM + UDPBUFFERSIZE) != 0) {
+    fprintf(stderr, "setup_buffers: out of memory\n");
+    exit(1);
+  }
+  udp_rx_buf = ptr;
+
+  if (posix_memalign(&ptr, CACHELINESIZE, UDPBUFFERSIZE) != 0) {
+    fprintf(stderr, "setup_buffers: out of memory\n");
+    exit(1);
+  }
+  tcp_rx_buf = ptr;
+
+  if (posix_memalign(&ptr, CACHELINESIZE, WIRLINESIZE) != 0) {
+    fprintf(stderr, "setup_buffers: out of memory\n");
+    exit(1);
+  }
+  wir_line_buf = ptr;
+} /* setup_buffers */
+
+
+/* setup_tracing()
+ * Allocate the relay's per-record latency stamps.  Exit if anything goes
+ * wrong.
+ */
+static void setup_tracing(struct relay *relay)
+{
+  relay->out_trace = (struct pending_trace *)
+    calloc(OUTTRACESLOTS, sizeof(struct pending_trace));
+  if (relay->out_trace == NULL) {
+    perror("setup_tracing: calloc");
+    exit(1);
+  }
+} /* setup_tracing */
+
+
+/* trace_sent()
+ * The relay's pending records have all been sent; account for their
+ * latency.
+ */
+static void trace_sent(struct relay *relay)
+{
+  uint64_t now = latency_now();
+  struct latency_trace_record rec;
+  struct pending_trace *t;
+  int i, n = relay->out_records;
+
+  if (n > OUTTRACESLOTS) n = OUTTRACESLOTS;
+
+  for (i = 0; i < n; i++) {
+    t = &relay->out_trace[i];
+    if (t->formatted == 0) {
+      continue;   /* not stamped, or queued by our predecessor */
     }
-    
-    for (int i = 0; i < deviceCount; i++){
-      if(nameMap[i].id == imei){
-        wirMessage.idMapIndex = i;
-        nameMap[wirMessage.idMapIndex].port = ntohs(remote_udpaddr.sin_port);
-        break;
-      }
+    rec.rx_time = t->rx_time;
+    rec.stage[LAT_RECV] = t->recv;
+    rec.stage[LAT_PARSE] = t->parse;
+    rec.stage[LAT_FORMAT] = t->format;
+    rec.stage[LAT_SEND] = now - t->formatted;
+    rec.stage[LAT_TOTAL] = t->recv + t->parse + t->format + rec.stage[LAT_SEND];
+    rec.length = t->length;
+    rec.device = t->device;
+
+    if (t->rx_time != 0) {
+      latency_record(LAT_RECV, rec.stage[LAT_RECV]);
+      latency_record(LAT_TOTAL, rec.stage[LAT_TOTAL]);
     }
-    fprintf(stderr, "Device registration imei: %lu\n",nameMap[wirMessage.idMapIndex].id);
-    fprintf(stderr, "Asigned port: %ld\n",nameMap[wirMessage.idMapIndex].port);
-  } else if(isCodec8(buflen, p.buf)){ // Check if message is codec 8 and then parse
-    
-    fprintf(stderr, "Codec8 Message\n");
-    wirCount = 0;
-    wirMessage.idMapIndex = deviceCount;
-    for(int i=0;i<wirMessage.idMapIndex;i++){
-      if(nameMap[i].port==ntohs(remote_udpaddr.sin_port)){ // if port is previously registered, load the map index
-        wirMessage.idMapIndex = i;
+    latency_record(LAT_PARSE, rec.stage[LAT_PARSE]);
+    latency_record(LAT_FORMAT, rec.stage[LAT_FORMAT]);
+    latency_record(LAT_SEND, rec.stage[LAT_SEND]);
+    if (t->sampled) {
+      latency_trace(&rec);
+    }
+  }
+} /* trace_sent */
+
+
+/* setup_low_latency()
+ * Pin the calling thread, which runs the I/O loop, to low_latency_cpu.
+ * Exit if anything goes wrong.
+ */
+static void setup_low_latency(void)
+{
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(low_latency_cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+    perror("setup_low_latency: sched_setaffinity");
+    exit(1);
+  }
+
+  if (debug) fprintf(stderr, "Low-latency mode: pinned to CPU %d\n",
+                     low_latency_cpu);
+} /* setup_low_latency */
+
+
+/* grow_sockbuf()
+ * Double the given buffer (SO_RCVBUF or SO_SNDBUF) of sock, up to
+ * max_sockbuf.  Return the resulting size, or -1 on failure.
+ */
+static int grow_sockbuf(int sock, int which)
+{
+  int size;
+  socklen_t len = sizeof(size);
+
+  if (getsockopt(sock, SOL_SOCKET, which, (void *)&size, &len) < 0) {
+    return -1;
+  }
+  if (size >= max_sockbuf) {
+    return size;
+  }
+  /* Linux reports twice the size it was asked for, so asking for the
+   * reported size doubles the buffer. */
+  if (size > max_sockbuf / 2) {
+    size = max_sockbuf / 2;
+  }
+  if (setsockopt(sock, SOL_SOCKET, which, (void *)&size, sizeof(size)) < 0 ||
+      getsockopt(sock, SOL_SOCKET, which, (void *)&size, &len) < 0) {
+    return -1;
+  }
+  return size;
+} /* grow_sockbuf */
+
+
+/* note_kernel_drops()
+ * The kernel's drop counter for the relay's UDP socket now reads count.
+ * If it has moved, log it and, unless --max-sockbuf is 0, give the UDP
+ * receive buffer (and the TCP send buffer that udp_to_tcp() may be
+ * blocked on) more room, at most once a second.
+ */
+static void note_kernel_drops(struct relay *relay, uint32_t count)
+{
+  time_t now;
+  int rcvbuf, sndbuf = -1;
+
+  if (count == relay->kernel_drops) {
+    return;
+  }
+  relay->kernel_drops = count;
+
+  now = now_sec();
+  if (now == relay->sockbuf_grown_at) {
+    return;
+  }
+  relay->sockbuf_grown_at = now;
+
+  if (max_sockbuf == 0) {
+    fprintf(stderr, "UDP port %hu: %u datagrams dropped by the kernel so "
+            "far\n", ntohs(relay->udpaddr.sin_port), count);
+    return;
+  }
+
+  rcvbuf = grow_sockbuf(relay->udp_recv_sock, SO_RCVBUF);
+  if (relay->tcp_state == tcp_connected) {
+    sndbuf = grow_sockbuf(relay->tcp_sock, SO_SNDBUF);
+  }
+  fprintf(stderr, "UDP port %hu: %u datagrams dropped by the kernel so far; "
+          "SO_RCVBUF %d, SO_SNDBUF %d\n", ntohs(relay->udpaddr.sin_port),
+          count, rcvbuf, sndbuf);
+} /* note_kernel_drops */
+
+
+/* setup_output_timer()
+ * Create the timerfd that bounds how long output may sit in the relay's
+ * batch.  Exit if anything goes wrong.
+ */
+static void setup_output_timer(struct relay *relay)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+  if ((relay->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    perror("setup_output_timer: timerfd_create");
+    exit(1);
+  }
+#endif
+  relay->timer_armed = 0;
+} /* setup_output_timer */
+
+
+/* set_output_timer()
+ * Arm the relay's flush timer to fire usec microseconds from now, or
+ * disarm it if usec is 0.  Return non-zero on failure.
+ */
+static int set_output_timer(struct relay *relay, long usec)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = usec / 1000000;
+  its.it_value.tv_nsec = (usec % 1000000) * 1000;
+  if (timerfd_settime(relay->timer_fd, 0, &its, NULL) < 0) {
+    perror("set_output_timer: timerfd_settime");
+    return 1;
+  }
+#endif
+  relay->timer_armed = (usec != 0);
+  return 0;
+} /* set_output_timer */
+
+
+/* keep_unsent()
+ * Sending the relay's pending output failed after sent bytes.  Drop the
+ * records that went out whole, keeping the rest, starting with the one
+ * that was cut short, for the next connection: the peer must never see
+ * the tail of a record without its start.
+ */
+static void keep_unsent(struct relay *relay, int sent)
+{
+  int i, n, base;
+
+  for (i = 0; i + 1 < relay->out_records && relay->out_starts[i + 1] <= sent;
+       i++)
+    ;
+  if (i == 0) {
+    return;
+  }
+
+  base = relay->out_starts[i];
+  n = relay->out_records - i;
+  memmove(relay->out_buf, relay->out_buf + base, relay->out_len - base);
+  relay->out_len -= base;
+  for (int j = 0; j < n; j++) {
+    relay->out_starts[j] = relay->out_starts[i + j] - base;
+  }
+  relay->out_records = n;
+
+  if (relay->out_trace != NULL) {
+    /* Records past OUTTRACESLOTS were never stamped. */
+    int stamped = i < OUTTRACESLOTS ? OUTTRACESLOTS - i : 0;
+
+    if (stamped > n) stamped = n;
+    memmove(relay->out_trace, relay->out_trace + i,
+            stamped * sizeof(struct pending_trace));
+    memset(relay->out_trace + stamped, 0,
+           (OUTTRACESLOTS - stamped) * sizeof(struct pending_trace));
+  }
+} /* keep_unsent */
+
+
+/* flush_output()
+ * Send all pending output of the relay to its TCP socket.  If we need to
+ * bail out, return non-zero.
+ */
+static int flush_output(struct relay *relay)
+{
+  unsigned char *data = (unsigned char *) relay->out_buf;
+  unsigned char *ptr, *end;
+  int len;
+
+  /* While reconnecting, output stays queued. */
+  if (relay->tcp_state != tcp_connected) {
+    return 0;
+  }
+
+  len = relay->out_len;
+  if (relay->zlink != NULL &&
+      (len = zlink_deflate(relay->zlink, relay->out_buf, relay->out_len,
+                           &data)) < 0) {
+    return tcp_client_failed(relay);
+  }
+
+  ptr = data;
+  end = data + len;
+  while (ptr < end) {
+    if ((len = send(relay->tcp_sock, ptr, end - ptr, 0)) < 0) {
+      if (errno == EINTR) continue;
+      perror("flush_output: send");
+      /* Keep what is unsent for the next connection.  A compressed batch
+       * is kept whole, to start the next connection's stream. */
+      if (relay->zlink == NULL) {
+        keep_unsent(relay, ptr - data);
       }
+      return tcp_client_failed(relay);
     }
-    if(wirMessage.idMapIndex != deviceCount){ // was ID Found?
-      wirMessage.id = nameMap[wirMessage.idMapIndex].id; 
-      fprintf(stderr, "Message from imei: %lu\n",wirMessage.id);
-    } else{ // Message sender not prevouosly registered
-      fprintf(stderr, "Unregistered Sender\n");
-    } 
-    revmemcpy(&wirMessage.gpsDateTime,&p.buf[10],sizeof(wirMessage.gpsDateTime)); // Load Timestamp
+    ptr += len;
+  }
+
+  if (relay->out_trace != NULL) {
+    trace_sent(relay);
+  }
+  if (debug > 1 && relay->out_records > 1) {
+    fprintf(stderr, "Flushed %d records, %d bytes\n", relay->out_records,
+            relay->out_len);
+  }
+  relay->out_len = 0;
+  relay->out_records = 0;
+
+  if (relay->timer_armed) {
+    return set_output_timer(relay, 0);
+  }
+  return 0;
+} /* flush_output */
+
+
+/* queue_output()
+ * Append a record to the relay's pending output, flushing according to
+ * the batching policy.  trace, if not NULL, holds the record's latency
+ * stamps so far.  If we need to bail out, return non-zero.
+ */
+static int queue_output(struct relay *relay, const void *data, int len,
+                        const struct pending_trace *trace)
+{
+  if (relay->out_len + len > OUTBUFFERSIZE) {
+    if (flush_output(relay)) {
+      return 1;
+    }
+    if (relay->out_len + len > OUTBUFFERSIZE) {
+      relay->out_dropped++;
+      return 0;
+    }
+  }
+  relay->out_starts[relay->out_records] = relay->out_len;
+  memcpy(relay->out_buf + relay->out_len, data, len);
+  relay->out_len += len;
+  if (relay->out_trace != NULL && relay->out_records < OUTTRACESLOTS) {
+    if (trace != NULL) {
+      relay->out_trace[relay->out_records] = *trace;
+    }
+    else {
+      /* Unstamped (a TCP device's record, or a tunnel frame); the slot
+       * must not keep an earlier batch's stamps. */
+      memset(&relay->out_trace[relay->out_records], 0,
+             sizeof(struct pending_trace));
+    }
+  }
+  relay->out_records++;
+
+  if ((flush_bytes != 0 && relay->out_len >= flush_bytes) ||
+      (flush_records != 0 && relay->out_records >= flush_records)) {
+    return flush_output(relay);
+  }
+
+  /* The first record of a batch starts the clock. */
+  if (relay->timer_fd != -1 && !relay->timer_armed) {
+    return set_output_timer(relay, flush_usec);
+  }
+  return 0;
+} /* queue_output */
+
+
+/* output_timer_expired()
+ * The relay's flush timer has fired; send whatever is pending.  If we need
+ * to bail out, return non-zero.
+ */
+static int output_timer_expired(struct relay *relay)
+{
+  uint64_t expirations;
+
+  if (read(relay->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    perror("output_timer_expired: read");
+    return 1;
+  }
+  relay->timer_armed = 0;
+  if (relay->out_len == 0) {
+    return 0;
+  }
+  return flush_output(relay);
+} /* output_timer_expired */
+
+
+/* tunnel_frame()
+ * Tunnel mode: queue len bytes of UDP payload at data as a frame, with a
+ * length header and, with --flows, the flow ID, on the stripe of the
+ * relay chosen by key.  data has TUNNELHEADROOM bytes free before it,
+ * where the header goes.  If we need to bail out, return non-zero.
+ */
+static int tunnel_frame(struct relay *relay, unsigned char *data, int len,
+                        int flow, uint32_t key)
+{
+  u_int16 header[2];
+  int header_len = relay->flows != NULL ? 2 * sizeof(u_int16)
+                                        : sizeof(u_int16);
+
+  /* A flow always takes the same stripe, so its frames stay in order. */
+  relay += key % stripe_count;
+
+  header[0] = htons(len);
+  header[1] = htons(flow);
+  memcpy(data - header_len, header, header_len);
+  return queue_output(relay, data - header_len, len + header_len, NULL);
+} /* tunnel_frame */
+
+
+/* tunnel_packet()
+ * Tunnel mode: queue the UDP packet of buflen bytes at rx, received from
+ * addr on the relay's UDP port.  If we need to bail out, return non-zero.
+ */
+static int tunnel_packet(struct relay *relay, unsigned char *rx, int buflen,
+                         const struct sockaddr_in *addr)
+{
+  int flow = 0;
+  uint32_t key;
+
+  if (debug > 1) {
+    fprintf(stderr, "Received %d byte UDP packet from %s/%hu\n", buflen,
+            inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+  }
+
+  if (relay->flows != NULL &&
+      (flow = flow_by_addr(relay->flows, addr, now_sec())) < 0) {
+    return 0;   /* out of flows; counted as refused */
+  }
+  key = relay->flows != NULL ? flow :
+        (addr->sin_addr.s_addr ^ addr->sin_port) * 2654435761u >> 16;
+  return tunnel_frame(relay, rx, buflen, flow, key);
+} /* tunnel_packet */
+
+
+/* flow_reply()
+ * A UDP packet has come back on the socket of one of the peer's flows;
+ * tunnel it back on the same flow.  If we need to bail out, return
+ * non-zero.
+ */
+static int flow_reply(void *ctx, int id, unsigned char *data, int len)
+{
+  return tunnel_frame((struct relay *) ctx, data, len, id | FLOW_REPLY, id);
+} /* flow_reply */
+
+/***************************** Telt - Wir Custom Code  v1.0 ******************************************/
+
+/* wir_to_binary()
+ * Write the decoded record as a wirbin record (see wirbin.h) to out,
+ * which has room for WIRLINESIZE bytes, and return its length.
+ */
+static int wir_to_binary(const struct atrack_wir_message *m,
+                         unsigned char *out)
+{
+  struct wirbin_record r;
+
+  r.imei = m->id;
+  r.time_ms = m->gpsDateTime;
+  r.latitude = m->latitude;
+  r.longitude = m->longitude;
+  r.odometer = m->odometer;
+  r.device = m->idMapIndex;
+  r.speed = m->speed;
+  r.heading = m->heading;
+  r.temperature = m->temperature1;
+  r.event = m->event;
+  return wirbin_encode(out, &r);
+} /* wir_to_binary */
+
+
+/* note_state()
+ * Keep the decoded record as its device's last known state, for
+ * --state-socket.
+ */
+static void note_state(const struct atrack_wir_message *m)
+{
+  struct devstate s;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s.imei = m->id;
+  s.name = nameMap[m->idMapIndex].name;
+  s.time_ms = m->gpsDateTime;
+  s.seen_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  s.latitude = m->latitude;
+  s.longitude = m->longitude;
+  s.speed = m->speed;
+  s.heading = m->heading;
+  s.temperature = m->temperature1;
+  devstate_update(m->idMapIndex, &s);
+} /* note_state */
+
+
+/* codec8_to_wir()
+ * Decode each AVL record of the Codec8 packet in rx (already checked by
+ * isCodec8()), sent by the device with nameMap index device (deviceCount
+ * if it has not registered), and queue a record for it on the relay, as a
+ * WIR line or, with --format=binary, a wirbin record.
+ * trace and received carry latency stamps for --latency-stats, or are NULL
+ * and 0.  Return the number of AVL records decoded, or -1 if we need to
+ * bail out.
+ */
+static int codec8_to_wir(struct relay *relay, unsigned char *rx, int buflen,
+                         int device, struct pending_trace *trace,
+                         uint64_t received)
+{
+  //////////// Custom Variables /////////////////
+  struct atrack_wir_message wirMessage = {};
+  char *line = wir_line_buf;
+  struct tm * ptm;
+	time_t epch;
+	float floatTemp;
+	float floatLat =0;
+	float floatLon =0;
+	int8_t wirCount=0;
+  uint16_t scanPointer;
+  uint8_t twoByteIOCount;
+  uint16_t record = 10; // first AVL record, after preamble, length, codec ID and count
+  uint16_t end = buflen - 5; // trailing record count and CRC
+  int records;
+  uint64_t parsed = 0;
+  /////////////////////////////
+
+  wirMessage.idMapIndex = device;
+  if(wirMessage.idMapIndex != deviceCount){ // was ID Found?
+    wirMessage.id = nameMap[wirMessage.idMapIndex].id; 
+    fprintf(stderr, "Message from imei: %lu\n",wirMessage.id);
+  } else{ // Message sender not prevouosly registered
+    fprintf(stderr, "Unregistered Sender\n");
+  } 
+
+  for (records = 0; records < rx[9]; records++) {
+    if (record + 27 > end) { // Truncated record; isCodec8() only checks the framing
+      break;
+    }
+    revmemcpy(&wirMessage.gpsDateTime,&rx[record],sizeof(wirMessage.gpsDateTime)); // Load Timestamp
 		epch=wirMessage.gpsDateTime/1000;
 		ptm = gmtime(&epch);
     fprintf(stderr, "DateTime: %02d/%02d/%02d %02d:%02d:%02d \n",ptm->tm_mday,ptm->tm_mon + 1,ptm->tm_year-100,ptm->tm_hour,ptm->tm_min,ptm->tm_sec);
-    revmemcpy(&wirMessage.latitude,&p.buf[23],sizeof(wirMessage.latitude)); // Load Latitude
+    revmemcpy(&wirMessage.latitude,&rx[record+13],sizeof(wirMessage.latitude)); // Load Latitude
 		floatLat=wirMessage.latitude;
 		floatLat/=10000000;
-		revmemcpy(&wirMessage.longitude,&p.buf[19],sizeof(wirMessage.longitude)); // Load Longitude
+		revmemcpy(&wirMessage.longitude,&rx[record+9],sizeof(wirMessage.longitude)); // Load Longitude
 		floatLon=wirMessage.longitude;
     floatLon/=10000000;
     fprintf(stderr, "Coordinates: %+09.5f,%+010.5f \n",floatLat,floatLon);
-    revmemcpy(&wirMessage.speed,&p.buf[32],sizeof(wirMessage.speed)); // Load Speed
-		revmemcpy(&wirMessage.heading,&p.buf[29],sizeof(wirMessage.heading)); // Load Heading
-		// revmemcpy(&wirMessage.event,&p.buf[34],sizeof(wirMessage.event)); // Load Event
+    revmemcpy(&wirMessage.speed,&rx[record+22],sizeof(wirMessage.speed)); // Load Speed
+		revmemcpy(&wirMessage.heading,&rx[record+19],sizeof(wirMessage.heading)); // Load Heading
+		// revmemcpy(&wirMessage.event,&rx[record+24],sizeof(wirMessage.event)); // Load Event
     wirMessage.event = 2; // temporarily send all events as 2 , event implementation pending
     wirMessage.odometer = 0; // No odometer implementation
     fprintf(stderr, "Speed: %03d Heading: %03d Event: %03d \n",wirMessage.speed,wirMessage.heading,wirMessage.event);
     
     wirMessage.temperature1 = -9900;
     wirMessage.humidity1 = 3000;
-    scanPointer=36; // set scan pointer to "N1 Of One Byte IO"
-    scanPointer += 1+(p.buf[scanPointer]*2); // offset all 1 byte IO Values, pointer now points to  "N2 Of two Byte IO"
-    twoByteIOCount = p.buf[scanPointer]; // How many two byte IO's were sent
+    scanPointer=record+26; // set scan pointer to "N1 Of One Byte IO"
+    scanPointer += 1+(rx[scanPointer]*2); // offset all 1 byte IO Values, pointer now points to  "N2 Of two Byte IO"
+    if (scanPointer >= end) break;
+    twoByteIOCount = rx[scanPointer]; // How many two byte IO's were sent
     scanPointer++; // Point to first two byte IO ID
+    if (scanPointer + twoByteIOCount*3 > end) break;
     for(uint8_t i = 0; i<twoByteIOCount; i++){ // Scan for Hum and Temp Values
-      if(p.buf[scanPointer] == 25)revmemcpy(&wirMessage.temperature1,&p.buf[scanPointer+1],sizeof(wirMessage.temperature1)); // Load Temp Value
-      else if(p.buf[scanPointer] == 86)revmemcpy(&wirMessage.humidity1,&p.buf[scanPointer+1],sizeof(wirMessage.humidity1)); // Load Hum Value
+      if(rx[scanPointer] == 25)revmemcpy(&wirMessage.temperature1,&rx[scanPointer+1],sizeof(wirMessage.temperature1)); // Load Temp Value
+      else if(rx[scanPointer] == 86)revmemcpy(&wirMessage.humidity1,&rx[scanPointer+1],sizeof(wirMessage.humidity1)); // Load Hum Value
       scanPointer += 3; // Read Next Value
     }
     if(wirMessage.humidity1 == 3000){ // If not found or sensor disconnected
@@ -585,17 +1698,41 @@ static int udp_to_tcp(struct relay *relay)
     floatTemp=wirMessage.temperature1; // Load to a float
     floatTemp/=100; // set decimal point where it's supposed to be
     fprintf(stderr, "Temperature: %+.0f \n",floatTemp);
+
+    if (scanPointer >= end) break;
+    scanPointer += 1+(rx[scanPointer]*5); // skip 4 byte IO Values, pointer now points to "N8 Of eight Byte IO"
+    if (scanPointer >= end) break;
+    scanPointer += 1+(rx[scanPointer]*9); // skip 8 byte IO Values, pointer now points to the next record
+    record = scanPointer;
     
+    if (trace != NULL) parsed = latency_now();
+
     if (wirMessage.idMapIndex != deviceCount){ // if device has previously registered
-      wirCount = sprintf(sendPacket.buf, "%s,%02d%02d%02d%02d%02d%02d,%+09.5f,%+010.5f,%03d,%03d,%03d,%d,%+.0f|", nameMap[wirMessage.idMapIndex].name,
-                         ptm->tm_mday, ptm->tm_mon + 1, ptm->tm_year - 100, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, floatLat, floatLon, wirMessage.speed, wirMessage.heading,
-                         wirMessage.event, wirMessage.odometer, floatTemp);
-      sendPacket.buf[wirCount] = 0;                  
-      fprintf(stderr, "%s\n",sendPacket.buf);
-      sendPacket.length = htons(wirCount);
-      if (send(relay->tcp_sock, (void *) &sendPacket.buf, wirCount, 0) < 0) {
-        perror("udp_to_tcp: send");
-        return 1;
+      if (state_path != NULL) {
+        note_state(&wirMessage);
+      }
+      if (output_format == OUTPUT_BINARY) {
+        wirCount = wir_to_binary(&wirMessage, (unsigned char *) line);
+      } else {
+        wirCount = sprintf(line, "%s,%02d%02d%02d%02d%02d%02d,%+09.5f,%+010.5f,%03d,%03d,%03d,%d,%+.0f|", nameMap[wirMessage.idMapIndex].name,
+                           ptm->tm_mday, ptm->tm_mon + 1, ptm->tm_year - 100, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, floatLat, floatLon, wirMessage.speed, wirMessage.heading,
+                           wirMessage.event, wirMessage.odometer, floatTemp);
+      }
+      if (trace != NULL) {
+        trace->formatted = latency_now();
+        trace->parse = parsed - received;
+        trace->format = trace->formatted - parsed;
+        trace->length = buflen;
+        trace->device = wirMessage.idMapIndex;
+        trace->sampled = trace_sample != 0 && ++trace_counter % trace_sample == 0;
+        received = trace->formatted; // the next record's parse starts here
+      }
+      if (output_format == OUTPUT_WIR) {
+        line[wirCount] = 0;
+        fprintf(stderr, "%s\n",line);
+      }
+      if (queue_output(relay, line, wirCount, trace)) {
+        return -1;
       }
 
       /*wirCount = sprintf(wirMessage.message, "%s,%02d%02d%02d%02d%02d%02d,%+09.5f,%+010.5f,%03d,%03d,%03d,%d,%+.0f|", nameMap[wirMessage.idMapIndex].name,
@@ -604,7 +1741,136 @@ static int udp_to_tcp(struct relay *relay)
       wirMessage.message[wirCount] = 0;                  
       fprintf(stderr, "%s\n",wirMessage.message);*/
     }
+  }
+
+  return records;
+} /* codec8_to_wir */
+
+
+/* udp_to_tcp()
+ * A packet has arrived on the UDP port of the relay.  Forward it to the TCP
+ * port.  If we need to bail out, return non-zero.
+ */
+static int udp_to_tcp(struct relay *relay)
+{
+  unsigned char *rx = udp_rx_buf + TUNNELHEADROOM;
+  int buflen;
+  struct sockaddr_in remote_udpaddr;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSGBUFFERSIZE];
+  struct pending_trace trace;
+  uint64_t received = 0;
+
+  //////////// Custom Variables /////////////////
+  uint64_t imei; 
+  struct atrack_wir_message wirMessage = {};
+  int device;
+  /////////////////////////////
+
+  iov.iov_base = rx;
+  iov.iov_len = UDPBUFFERSIZE;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &remote_udpaddr;
+  msg.msg_namelen = sizeof(remote_udpaddr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if ((buflen = recvmsg(relay->udp_recv_sock, &msg, 0)) <= 0) {
+    if (buflen < 0) {
+      perror("udp_to_tcp: recv");
+    }
+    return 1;
+  }
+
+  if (latency_stats) {
+    received = latency_now();
+    memset(&trace, 0, sizeof(trace));
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef HAVE_RX_TIMESTAMPS
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      /* Three timespecs; the first is the software timestamp. */
+      struct timespec kernel_ts, now_ts;
+
+      memcpy(&kernel_ts, CMSG_DATA(cmsg), sizeof(kernel_ts));
+      clock_gettime(CLOCK_REALTIME, &now_ts);
+      trace.rx_time = (uint64_t)kernel_ts.tv_sec * 1000000000 + kernel_ts.tv_nsec;
+      trace.recv = (uint64_t)now_ts.tv_sec * 1000000000 + now_ts.tv_nsec -
+                   trace.rx_time;
+    }
+#endif
+#ifdef SO_RXQ_OVFL
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      note_kernel_drops(relay, drops);
+    }
+#endif
+  }
 
+  /* Admission control comes before any parsing or logging, so that a
+   * flood costs us no more than the recvmsg() it took to read it. */
+  if (!admit_packet(remote_udpaddr.sin_addr.s_addr,
+                    port_device[ntohs(remote_udpaddr.sin_port)] - 1)) {
+    return 0;
+  }
+
+  if (tunnel_mode) {
+    return tunnel_packet(relay, rx, buflen, &remote_udpaddr);
+  }
+
+  if (debug > 1) {
+    fprintf(stderr, "\nReceived %d byte UDP packet from %s/%hu\n", buflen,
+            inet_ntoa(remote_udpaddr.sin_addr),
+            ntohs(remote_udpaddr.sin_port));
+    /* Print the buffer */      
+    for(int i = 0; i<buflen ; i++){
+      fprintf(stderr, "%02X ",rx[i]); 
+    }
+    fprintf(stderr, "\n");
+    /* End Of Print the buffer */ 
+  }
+
+  if(buflen== 17 && rx[0]== 0x00 && rx[1]== 0x0F){ // Imei Registration to Server
+    imei = 0;
+    for(int i = 2; i<buflen ; i++){
+      imei *= 10;
+      imei += (rx[i]-0x30);
+    }
+    
+    for (int i = 0; i < deviceCount; i++){
+      if(nameMap[i].id == imei){
+        wirMessage.idMapIndex = i;
+        if (port_device[nameMap[i].port] == i + 1) {
+          port_device[nameMap[i].port] = 0;
+        }
+        nameMap[wirMessage.idMapIndex].port = ntohs(remote_udpaddr.sin_port);
+        port_device[nameMap[i].port] = i + 1;
+        break;
+      }
+    }
+    fprintf(stderr, "Device registration imei: %lu\n",nameMap[wirMessage.idMapIndex].id);
+    fprintf(stderr, "Asigned port: %ld\n",nameMap[wirMessage.idMapIndex].port);
+  } else if(isCodec8(buflen, rx)){ // Check if message is codec 8 and then parse
+    
+    fprintf(stderr, "Codec8 Message\n");
+    device = deviceCount;
+    for(int i=0;i<deviceCount;i++){
+      if(nameMap[i].port==ntohs(remote_udpaddr.sin_port)){ // if port is previously registered, load the map index
+        device = i;
+      }
+    }
+    if (codec8_to_wir(relay, rx, buflen, device,
+                      latency_stats ? &trace : NULL, received) < 0) {
+      return 1;
+    }
   } // End of Codec8 Message parser
 
 /* Original Send
@@ -618,6 +1884,78 @@ static int udp_to_tcp(struct relay *relay)
 } /* udp_to_tcp */
 
 
+/* device_by_imei()
+ * A device has connected to the TCP listener and sent its IMEI.  Return
+ * its nameMap index, or -1 to refuse it.
+ */
+static int device_by_imei(uint64_t imei)
+{
+  for (int i = 0; i < deviceCount; i++){
+    if(nameMap[i].id == imei){
+      if (debug) fprintf(stderr, "TCP device registration imei: %lu\n", imei);
+      return i;
+    }
+  }
+  fprintf(stderr, "Refused TCP device imei: %lu\n", imei);
+  return -1;
+} /* device_by_imei */
+
+
+/* device_frame()
+ * A complete Codec8 frame has arrived from a TCP device.  Decode it onto
+ * the WIR output like a UDP packet, and return the number of records to
+ * acknowledge (see devconn.h).
+ */
+static int device_frame(unsigned char *frame, int len, int device,
+                        uint32_t peer)
+{
+  unsigned long dropped;
+  int records;
+
+  /* Acknowledging nothing makes the device send the frame again later. */
+  if (!admit_packet(peer, device)) {
+    return 0;
+  }
+
+  if (!isCodec8(len, frame)) {
+    fprintf(stderr, "Malformed Codec8 frame from %s\n", nameMap[device].name);
+    return DEVCONN_CLOSE;
+  }
+
+  fprintf(stderr, "Codec8 Message\n");
+  dropped = device_relay->out_dropped;
+  if ((records = codec8_to_wir(device_relay, frame, len, device, NULL, 0)) < 0) {
+    return DEVCONN_FATAL;
+  }
+  /* Records lost to a full output buffer must not be acknowledged, so
+   * that the device sends them again. */
+  if (device_relay->out_dropped != dropped) {
+    return 0;
+  }
+  return records;
+} /* device_frame */
+
+
+/* setup_device_listener()
+ * Start accepting Codec8 devices over TCP on device_port.
+ * Exit if anything goes wrong.
+ */
+static void setup_device_listener(void)
+{
+  struct sockaddr_in addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(device_port);
+
+  devconn_init(&addr, device_by_imei, device_frame);
+
+  if (debug) fprintf(stderr, "Listening for TCP devices on port %d\n",
+                     device_port);
+} /* setup_device_listener */
+
+
 
 
 /************************************ End Of Custom Code ****************************************/
@@ -657,14 +1995,180 @@ static int udp_to_tcp(struct relay *relay)
 /*********************** End Of Original Function **********************/
 
 
+/* add_pollfd()
+ * Append fd to the poll set and return its index there.
+ */
+static int add_pollfd(struct pollfd *fds, int *nfds, int fd, short events)
+{
+  fds[*nfds].fd = fd;
+  fds[*nfds].events = events;
+  fds[*nfds].revents = 0;
+  return (*nfds)++;
+} /* add_pollfd */
+
+
+/* request_stats()
+ * SIGUSR1 handler: ask the main loop to print its counters.
+ */
+static void request_stats(int sig)
+{
+  stats_requested = 1;
+} /* request_stats */
+
+
+/* print_stats()
+ * Print the admission control and output counters on stderr.
+ */
+static void print_stats(struct relay *relays, int relay_count)
+{
+  int i;
+  time_t now, elapsed;
+
+  fprintf(stderr, "Admission: %llu passed, %llu dropped by source, "
+          "%llu dropped by device\n",
+          (unsigned long long) admit_stats.passed,
+          (unsigned long long) admit_stats.src_drops,
+          (unsigned long long) admit_stats.dev_drops);
+  now = now_sec();
+  for (i = 0; i < relay_count; i++) {
+    if (relays[i].out_dropped != 0) {
+      fprintf(stderr, "Relay %d: %lu records dropped while disconnected\n",
+              i, relays[i].out_dropped);
+    }
+    if (relays[i].zlink != NULL) {
+      zlink_stats(relays[i].zlink, stderr, i);
+    }
+    if (relays[i].stripe != 0) {
+      continue;   /* the UDP side is the first stripe's */
+    }
+    /* Drop rate since the last report (or since startup). */
+    elapsed = now - relays[i].drops_reported_at;
+    fprintf(stderr, "Relay %d: %u datagrams dropped by the kernel, "
+            "%.1f/s over the last %ld s\n", i, relays[i].kernel_drops,
+            elapsed > 0 ? (double)(relays[i].kernel_drops -
+                                   relays[i].kernel_drops_reported) / elapsed
+                        : 0.0,
+            (long) elapsed);
+    relays[i].kernel_drops_reported = relays[i].kernel_drops;
+    relays[i].drops_reported_at = now;
+    if (relays[i].flows != NULL) {
+      flow_stats(relays[i].flows, stderr, i);
+    }
+  }
+  if (latency_stats) {
+    latency_dump(stderr);
+  }
+  devconn_stats(stderr);
+  for (i = 0; i < deviceCount; i++) {
+    if (admit_device_drops(i) != 0) {
+      fprintf(stderr, "  %s: %u dropped\n", nameMap[i].name,
+              admit_device_drops(i));
+    }
+  }
+} /* print_stats */
+
+
+/* deliver_packets()
+ * Send every complete packet in the relay's TCP buffer to the UDP port,
+ * and move what is left to the front.  If we need to bail out, return
+ * non-zero.
+ */
+static int deliver_packets(struct relay *relay)
+{
+  u_int16 header[2];
+  int header_len = relay->flows != NULL ? 2 * sizeof(u_int16)
+                                        : sizeof(u_int16);
+  int sock;
+  const struct sockaddr_in *addr;
+  time_t now = relay->flows != NULL ? now_sec() : 0;
+
+  for (;;) {
+    if (relay->state == reading_length) {
+      if (relay->buf_ptr - relay->packet_start < header_len) {
+        break;
+      }
+      memcpy(header, relay->packet_start, header_len);
+      relay->packet_length = ntohs(header[0]);
+      relay->packet_flow = ntohs(header[1]);
+      relay->packet_start += header_len;
+      relay->state = reading_packet;
+    }
+    if (relay->buf_ptr - relay->packet_start < relay->packet_length) {
+      break;
+    }
+    /* If we get here, we have a complete UDP packet to send */
+    if (debug > 1) {
+      fprintf(stderr, "Received packet on TCP, length %u; sending as UDP\n",
+              relay->packet_length);
+    }
+
+    /* With --flows, a reply goes back to the peer that opened the flow,
+     * and anything else out through the flow's own socket. */
+    sock = relay->udp_send_sock;
+    addr = NULL;
+    if (relay->flows != NULL) {
+      if (relay->packet_flow & FLOW_REPLY) {
+        sock = relay->udp_recv_sock;
+        addr = flow_addr(relay->flows, relay->packet_flow & ~FLOW_REPLY, now);
+      }
+      else {
+        sock = flow_socket(relay->flows, relay->packet_flow,
+                           &relay->udpaddr, now);
+      }
+      if (sock == -1 || (relay->packet_flow & FLOW_REPLY && addr == NULL)) {
+        /* The flow has expired here, or is refused; drop the packet. */
+        relay->packet_start += relay->packet_length;
+        relay->state = reading_length;
+        continue;
+      }
+    }
+
+    if (sendto(sock, relay->packet_start, relay->packet_length, 0,
+               (struct sockaddr *) addr, addr ? sizeof(*addr) : 0) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* A flow socket's send buffer is full; drop the packet. */
+      }
+      else if (errno != ECONNREFUSED) {
+        perror("tcp_to_udp: send");
+        return 1;
+      }
+      else {
+        /* There isn't a UDP listener waiting on the other end, but
+         * that's okay, it's probably just not up at the moment or something.
+         * Use getsockopt(SO_ERROR) to clear the error state. */
+        int err, len = sizeof(err);
+
+        if (debug > 1) {
+          fprintf(stderr, "ECONNREFUSED on udp_send_sock; clearing.\n");
+        }
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                       (void *)&err, &len) < 0) {
+          perror("tcp_to_udp: getsockopt(SO_ERROR)");
+          return 1;
+        }
+      }
+    }
+    relay->packet_start += relay->packet_length;
+    relay->state = reading_length;
+  }
+
+  memmove(relay->buf, relay->packet_start,
+          relay->buf_ptr - relay->packet_start);
+  relay->buf_ptr -= relay->packet_start - relay->buf;
+  relay->packet_start = relay->buf;
+  return 0;
+} /* deliver_packets */
+
+
 /* tcp_to_udp()
- * The TCP socket of the relay has something for us to read.  Read it; if we
- * have a complete packet, send it to the UDP port.  If we need to bail out,
+ * The TCP socket of the relay has something for us to read.  Read it, and
+ * send each complete packet to the UDP port.  If we need to bail out,
  * return non-zero.
  */
 static int tcp_to_udp(struct relay *relay)
 {
-  int read_len;
+  int read_len, n;
+  unsigned char *in;
 
   if (relay->state == uninitialized) {
     relay->state = reading_length;
@@ -673,62 +2177,310 @@ static int tcp_to_udp(struct relay *relay)
     relay->packet_length = 0;
   }
 
-  if ((read_len = read(relay->tcp_sock, relay->buf_ptr,
-                       (relay->buf + TCPBUFFERSIZE - relay->buf_ptr))) <= 0) {
+  if (relay->zlink == NULL) {
+    if ((read_len = read(relay->tcp_sock, relay->buf_ptr,
+                         (relay->buf + TCPBUFFERSIZE - relay->buf_ptr))) <= 0) {
+      if (read_len < 0) {
+        perror("tcp_to_udp: read");
+      }
+      return 1;
+    }
+    relay->buf_ptr += read_len;
+    return deliver_packets(relay);
+  }
+
+  if ((read_len = read(relay->tcp_sock, tcp_rx_buf, UDPBUFFERSIZE)) <= 0) {
     if (read_len < 0) {
       perror("tcp_to_udp: read");
     }
     return 1;
   }
-    
-  relay->buf_ptr += read_len;
-  if (relay->state == reading_length) {
-    if (relay->buf_ptr - relay->packet_start < sizeof(u_int16)) {
-      return 0;
+
+  /* Inflate as much as fits, deliver it, and repeat until the input is
+   * used up; the buffer always has room for a whole packet. */
+  in = tcp_rx_buf;
+  do {
+    n = zlink_inflate(relay->zlink, &in, &read_len,
+                      (unsigned char *) relay->buf_ptr,
+                      relay->buf + TCPBUFFERSIZE - relay->buf_ptr);
+    if (n < 0) {
+      return 1;
+    }
+    relay->buf_ptr += n;
+    if (deliver_packets(relay)) {
+      return 1;
+    }
+  } while (read_len > 0 || n > 0);
+
+  return 0;
+} /* tcp_to_udp */
+
+
+/* send_state()
+ * Pass every socket we have, and the session state that goes with them,
+ * to a successor on sock.  Return non-zero on failure.
+ */
+static int send_state(int sock, struct relay *relays, int relay_count,
+                      int is_server)
+{
+  struct relay_snapshot snap;
+  struct {
+    uint64_t count;
+    struct registration_snapshot reg[deviceCount];
+  } regs;
+  struct relay *relay;
+  int fds[4];
+  int i, nfds;
+
+  for (i = 0; i < relay_count; i++) {
+    relay = &relays[i];
+    memset(&snap, 0, sizeof(snap));
+    nfds = 0;
+    fds[nfds++] = relay->udp_recv_sock;
+    fds[nfds++] = relay->udp_send_sock;
+    if (is_server) {
+      fds[nfds++] = relay->tcp_listen_sock;
+    }
+    if (relay->tcp_state == tcp_connected) {
+      snap.connected = 1;
+      fds[nfds++] = relay->tcp_sock;
+    }
+    snap.state = relay->state;
+    if (relay->state != uninitialized) {
+      snap.buf_len = relay->buf_ptr - relay->buf;
+      snap.packet_start = relay->packet_start - relay->buf;
+      snap.packet_length = relay->packet_length;
+    }
+    snap.out_len = relay->out_len;
+    snap.out_records = relay->out_records;
+    snap.kernel_drops = relay->kernel_drops;
+    snap.out_dropped = relay->out_dropped;
+
+    if (handoff_send(sock, &snap, sizeof(snap), fds, nfds) ||
+        (snap.buf_len > 0 &&
+         handoff_send(sock, relay->buf, snap.buf_len, NULL, 0)) ||
+        (snap.out_len > 0 &&
+         handoff_send(sock, relay->out_buf, snap.out_len, NULL, 0)) ||
+        (snap.out_records > 0 &&
+         handoff_send(sock, relay->out_starts,
+                      snap.out_records * sizeof(relay->out_starts[0]),
+                      NULL, 0))) {
+      return 1;
+    }
+  }
+
+  regs.count = 0;
+  for (i = 0; i < deviceCount; i++) {
+    if (nameMap[i].port != 0) {
+      regs.reg[regs.count].imei = nameMap[i].id;
+      regs.reg[regs.count].port = nameMap[i].port;
+      regs.count++;
     }
-    relay->packet_length = ntohs(*(u_int16 *)relay->packet_start);
-    relay->packet_start += sizeof(u_int16);
-    relay->state = reading_packet;
   }
-  if (relay->buf_ptr - relay->packet_start < relay->packet_length) {
+  if (handoff_send(sock, &regs, sizeof(regs.count) +
+                   regs.count * sizeof(regs.reg[0]), NULL, 0)) {
+    return 1;
+  }
+
+  if (device_port != 0 && devconn_handoff(sock)) {
+    return 1;
+  }
+  return 0;
+} /* send_state */
+
+
+/* serve_handoff()
+ * A successor has connected to our handoff socket.  If its configuration
+ * matches ours, pass it our sockets and state, and return non-zero once it
+ * says it has taken over, for us to exit.  We keep our own copies of
+ * everything meanwhile, so on any failure we return 0 and carry on.
+ */
+static int serve_handoff(struct relay *relays, int relay_count, int is_server)
+{
+  struct handoff_hello hello;
+  struct timeval tv;
+  int sock, nfds, done;
+
+  if ((sock = accept4(handoff_listen_sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+    perror("serve_handoff: accept");
     return 0;
   }
-  /* If we get here, we have a complete UDP packet to send */
-  if (debug > 1) {
-    fprintf(stderr, "Received packet on TCP, length %u; sending as UDP\n",
-            relay->packet_length);
+
+  /* Nothing is relayed while we wait, so never wait for long. */
+  tv.tv_sec = HANDOFF_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+  nfds = 0;
+  if (handoff_recv(sock, &hello, sizeof(hello), NULL, &nfds) !=
+      sizeof(hello)) {
+    close(sock);
+    return 0;
   }
-  if (send(relay->udp_send_sock, relay->packet_start,
-           relay->packet_length, 0) < 0) {
-    if (errno != ECONNREFUSED) {
-      perror("tcp_to_udp: send");
-      return 1;
+  hello.status = hello.magic != HANDOFF_MAGIC ||
+                 hello.version != HANDOFF_VERSION ||
+                 hello.relay_count != relay_count ||
+                 hello.is_server != is_server ||
+                 hello.device_port != device_port ||
+                 hello.output_format != output_format ||
+                 hello.tunnel_mode != tunnel_mode ||
+                 hello.stripe_count != stripe_count;
+  if (hello.status) {
+    fprintf(stderr, "Refusing handoff to a differently configured "
+            "successor\n");
+  }
+
+  done = 0;
+  if (handoff_send(sock, &hello, sizeof(hello), NULL, 0) == 0 &&
+      hello.status == 0 &&
+      send_state(sock, relays, relay_count, is_server) == 0) {
+    nfds = 0;
+    done = handoff_recv(sock, &hello, sizeof(hello), NULL, &nfds) ==
+           sizeof(hello) && hello.status == 0;
+    if (!done) {
+      fprintf(stderr, "Successor did not take over; carrying on\n");
+    }
+  }
+  close(sock);
+
+  if (done && debug) {
+    fprintf(stderr, "Handed off to successor\n");
+  }
+  return done;
+} /* serve_handoff */
+
+
+/* take_over()
+ * At startup, with a predecessor on sock: take over its sockets and state
+ * instead of setting up our own.  Exit if anything goes wrong; our
+ * predecessor carries on.
+ */
+static void take_over(int sock, struct relay *relays, int relay_count,
+                      int is_server)
+{
+  struct handoff_hello hello;
+  struct relay_snapshot snap;
+  struct {
+    uint64_t count;
+    struct registration_snapshot reg[deviceCount];
+  } regs;
+  struct relay *relay;
+  ssize_t n;
+  int fds[4];
+  int i, j, nfds;
+
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = HANDOFF_MAGIC;
+  hello.version = HANDOFF_VERSION;
+  hello.relay_count = relay_count;
+  hello.is_server = is_server;
+  hello.device_port = device_port;
+  hello.output_format = output_format;
+  hello.tunnel_mode = tunnel_mode;
+  hello.stripe_count = stripe_count;
+
+  nfds = 0;
+  if (handoff_send(sock, &hello, sizeof(hello), NULL, 0) ||
+      handoff_recv(sock, &hello, sizeof(hello), NULL, &nfds) !=
+      sizeof(hello)) {
+    fprintf(stderr, "take_over: no answer from predecessor\n");
+    exit(1);
+  }
+  if (hello.status != 0) {
+    fprintf(stderr, "take_over: predecessor refused; its configuration "
+            "differs\n");
+    exit(1);
+  }
+
+  for (i = 0; i < relay_count; i++) {
+    relay = &relays[i];
+    nfds = 4;
+    if (handoff_recv(sock, &snap, sizeof(snap), fds, &nfds) != sizeof(snap) ||
+        nfds != 2 + is_server + (snap.connected != 0) ||
+        snap.buf_len < 0 || snap.buf_len > TCPBUFFERSIZE ||
+        snap.packet_start < 0 || snap.packet_start > snap.buf_len ||
+        snap.out_len < 0 || snap.out_len > OUTBUFFERSIZE ||
+        snap.out_records < 0 || snap.out_records > OUTRECORDSLOTS ||
+        (snap.out_records == 0) != (snap.out_len == 0)) {
+      fprintf(stderr, "take_over: bad relay state from predecessor\n");
+      exit(1);
     }
-    else {
-      /* There isn't a UDP listener waiting on the other end, but
-       * that's okay, it's probably just not up at the moment or something.
-       * Use getsockopt(SO_ERROR) to clear the error state. */
-      int err, len = sizeof(err);
 
-      if (debug > 1) {
-        fprintf(stderr, "ECONNREFUSED on udp_send_sock; clearing.\n");
+    relay->udp_recv_sock = fds[0];
+    relay->udp_send_sock = fds[1];
+    if (is_server) {
+      relay->tcp_listen_sock = fds[2];
+    }
+    if (snap.connected) {
+      relay->tcp_sock = fds[nfds - 1];
+      relay->tcp_state = tcp_connected;
+    }
+    setup_udp_recv_options(relay);
+
+    relay->state = snap.state == reading_length ? reading_length :
+                   snap.state == reading_packet ? reading_packet :
+                   uninitialized;
+    relay->buf_ptr = relay->buf + snap.buf_len;
+    relay->packet_start = relay->buf + snap.packet_start;
+    relay->packet_length = snap.packet_length;
+    relay->out_len = snap.out_len;
+    relay->out_records = snap.out_records;
+    relay->kernel_drops = relay->kernel_drops_reported = snap.kernel_drops;
+    relay->out_dropped = snap.out_dropped;
+
+    nfds = 0;
+    if ((snap.buf_len > 0 &&
+         handoff_recv(sock, relay->buf, TCPBUFFERSIZE, NULL, &nfds) !=
+         snap.buf_len) ||
+        (snap.out_len > 0 &&
+         handoff_recv(sock, relay->out_buf, OUTBUFFERSIZE, NULL, &nfds) !=
+         snap.out_len) ||
+        (snap.out_records > 0 &&
+         handoff_recv(sock, relay->out_starts, sizeof(relay->out_starts),
+                      NULL, &nfds) !=
+         (ssize_t)(snap.out_records * sizeof(relay->out_starts[0])))) {
+      fprintf(stderr, "take_over: bad relay state from predecessor\n");
+      exit(1);
+    }
+    for (j = 0; j < relay->out_records; j++) {
+      if (relay->out_starts[j] >= relay->out_len ||
+          (j == 0 ? relay->out_starts[j] != 0 :
+           relay->out_starts[j] <= relay->out_starts[j - 1])) {
+        fprintf(stderr, "take_over: bad relay state from predecessor\n");
+        exit(1);
       }
-      if (getsockopt(relay->udp_send_sock, SOL_SOCKET, SO_ERROR,
-                     (void *)&err, &len) < 0) {
-        perror("tcp_to_udp: getsockopt(SO_ERROR)");
-        return 1;
+    }
+
+    /* A client connection that was not up yet is made afresh. */
+    if (!snap.connected && !is_server) {
+      start_tcp_client(relay);
+    }
+  }
+
+  nfds = 0;
+  if ((n = handoff_recv(sock, &regs, sizeof(regs), NULL, &nfds)) <
+      (ssize_t) sizeof(regs.count) ||
+      n != sizeof(regs.count) + regs.count * sizeof(regs.reg[0])) {
+    fprintf(stderr, "take_over: bad registrations from predecessor\n");
+    exit(1);
+  }
+  for (j = 0; j < regs.count; j++) {
+    for (i = 0; i < deviceCount; i++) {
+      if (nameMap[i].id == regs.reg[j].imei && regs.reg[j].port < 65536) {
+        nameMap[i].port = regs.reg[j].port;
+        port_device[nameMap[i].port] = i + 1;
       }
     }
   }
 
-  memmove(relay->buf, relay->packet_start + relay->packet_length,
-          relay->buf_ptr - (relay->packet_start + relay->packet_length));
-  relay->buf_ptr -= relay->packet_length + (relay->packet_start - relay->buf);
-  relay->packet_start = relay->buf;
-  relay->state = reading_length;
+  if (device_port != 0) {
+    devconn_takeover(sock, device_by_imei, device_frame);
+  }
 
-  return 0;
-} /* tcp_to_udp */
+  if (debug) fprintf(stderr, "Took over from predecessor: %d relays, "
+                     "%d registered devices\n", relay_count, (int) regs.count);
+} /* take_over */
 
 
 int main(int argc, char *argv[])
@@ -736,51 +2488,244 @@ int main(int argc, char *argv[])
   struct relay *relays;
   int relay_count, is_server;
   int i;
-  fd_set readfds;
-  int max = 0;
+  struct pollfd *fds;
+  struct {
+    int tcp, udp, timer;   /* indices into fds, -1 if not polled */
+  } *slots;
+  int nfds, resolver_slot, devconn_slot, handoff_slot, flow_slot;
+  int handoff_sock = -1;
+  struct handoff_hello hello;
   int ok;
+  struct sigaction sa;
+  int timeout, wait;
+  time_t now, flows_expired_at = 0, devices_expired_at = 0;
 
   parse_args(argc, argv, &relays, &relay_count, &is_server);
 
+  admit_init(deviceCount);
+  setup_buffers();
+  if (flow_max != 0) {
+    flow_init(flow_reply, udp_rx_buf + TUNNELHEADROOM, UDPBUFFERSIZE);
+  }
+#ifndef HAVE_RX_TIMESTAMPS
+  if (latency_stats) {
+    fprintf(stderr, "%s: Kernel receive timestamps are not supported on this "
+            "platform; the recv stage will not be measured.\n", argv[0]);
+  }
+#endif
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stats;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+    perror("sigaction(SIGUSR1)");
+    exit(1);
+  }
+
+  if (!is_server) {
+    resolver_init(dns_ttl);
+  }
+
+  if (handoff_path != NULL) {
+    handoff_sock = handoff_connect(handoff_path);
+  }
+
+  if (handoff_sock != -1) {
+    take_over(handoff_sock, relays, relay_count, is_server);
+  }
+  else {
+    for (i = 0; i < relay_count; i++) {
+      if (relays[i].stripe != 0) {
+        setup_stripe(&relays[i]);
+      }
+      else {
+        if (is_server) {
+          setup_server_listen(&relays[i]);
+        }
+        setup_udp_recv(&relays[i]);
+        setup_udp_send(&relays[i]);
+      }
+      if (!is_server) {
+        start_tcp_client(&relays[i]);
+      }
+    }
+  }
+
   for (i = 0; i < relay_count; i++) {
-    if (is_server) {
-      setup_server_listen(&relays[i]);
+    if (flush_usec != 0) {
+      setup_output_timer(&relays[i]);
     }
-    else {
-      setup_tcp_client(&relays[i]);
+    if (latency_stats) {
+      setup_tracing(&relays[i]);
     }
-    setup_udp_recv(&relays[i]);
-    setup_udp_send(&relays[i]);
   }
 
   if (is_server) {
     await_incoming_connections(relays, relay_count);
   }
 
+  for (i = 0; i < relay_count; i++) {
+    relays[i].drops_reported_at = now_sec();
+  }
+
+  if (device_port != 0 && handoff_sock == -1) {
+    setup_device_listener();
+  }
+
+  if (state_path != NULL) {
+    devstate_init(deviceCount, state_path);
+  }
+
+  if (handoff_path != NULL) {
+    handoff_listen_sock = handoff_listen(handoff_path);
+  }
+
+  if (handoff_sock != -1) {
+    /* Tell our predecessor to go, and send what it left pending. */
+    memset(&hello, 0, sizeof(hello));
+    if (handoff_send(handoff_sock, &hello, sizeof(hello), NULL, 0)) {
+      exit(1);
+    }
+    close(handoff_sock);
+    for (i = 0; i < relay_count; i++) {
+      if (relays[i].out_len != 0 && flush_output(&relays[i])) {
+        exit(1);
+      }
+    }
+  }
+
+  /* Each relay polls up to three descriptors; then the resolver's, the
+   * device listener's, the handoff socket's and the flow sockets'. */
+  fds = (struct pollfd *) calloc(relay_count * 3 + 4, sizeof(struct pollfd));
+  slots = calloc(relay_count, sizeof(*slots));
+  if (fds == NULL || slots == NULL) {
+    perror("Error allocating poll set");
+    exit(1);
+  }
+
+  /* Pin only now, so that the resolver thread is not stuck on our CPU. */
+  if (low_latency_cpu != -1) {
+    setup_low_latency();
+  }
+
   do {
-    FD_ZERO(&readfds);
+    nfds = 0;
+    timeout = -1;
+    now = now_sec();
+    resolver_slot = is_server ? -1 : add_pollfd(fds, &nfds, resolver_fd(), POLLIN);
+    devconn_slot = device_port == 0 ? -1 :
+                   add_pollfd(fds, &nfds, devconn_fd(), POLLIN);
+    handoff_slot = handoff_listen_sock == -1 ? -1 :
+                   add_pollfd(fds, &nfds, handoff_listen_sock, POLLIN);
+    flow_slot = flow_max == 0 ? -1 : add_pollfd(fds, &nfds, flow_fd(), POLLIN);
+    if (flow_max != 0 || device_port != 0) {
+      timeout = 1000;   /* to expire idle flows and device connections */
+    }
     for (i = 0; i < relay_count; i++) {
-      FD_SET(relays[i].tcp_sock, &readfds);
-      SET_MAX(relays[i].tcp_sock);
-      FD_SET(relays[i].udp_recv_sock, &readfds);
-      SET_MAX(relays[i].udp_recv_sock);
+      slots[i].tcp = -1;
+      if (relays[i].tcp_state == tcp_connected) {
+        slots[i].tcp = add_pollfd(fds, &nfds, relays[i].tcp_sock, POLLIN);
+      }
+      else if (relays[i].tcp_state == tcp_connecting) {
+        slots[i].tcp = add_pollfd(fds, &nfds, relays[i].tcp_sock, POLLOUT);
+      }
+      else if (relays[i].tcp_state == tcp_waiting) {
+        wait = relays[i].retry_at > now ? (relays[i].retry_at - now) * 1000 : 0;
+        if (timeout == -1 || wait < timeout) {
+          timeout = wait;
+        }
+      }
+      slots[i].udp = relays[i].stripe != 0 ? -1 :
+                     add_pollfd(fds, &nfds, relays[i].udp_recv_sock, POLLIN);
+      slots[i].timer = relays[i].timer_fd == -1 ? -1 :
+                       add_pollfd(fds, &nfds, relays[i].timer_fd, POLLIN);
     }
 
-    if (select(max, &readfds, NULL, NULL, NULL) < 0) {
+    /* In low-latency mode, never sleep in poll(); spin instead. */
+    if (low_latency_cpu != -1) {
+      timeout = 0;
+    }
+
+    if (poll(fds, nfds, timeout) < 0) {
       if (errno != EINTR) {
-        perror("main loop: select");
+        perror("main loop: poll");
         exit(1);
       }
+      for (i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+      }
+    }
+
+    if (stats_requested) {
+      stats_requested = 0;
+      print_stats(relays, relay_count);
+    }
+
+    if (POLL_READY(fds, resolver_slot)) {
+      resolver_drain();
     }
 
     ok = 0;
+    now = now_sec();
     for (i = 0; i < relay_count; i++) {
-      if (FD_ISSET(relays[i].tcp_sock, &readfds)) {
-        ok += tcp_to_udp(&relays[i]);
+      switch (relays[i].tcp_state) {
+      case tcp_connected:
+        if (POLL_READY(fds, slots[i].tcp) && tcp_to_udp(&relays[i])) {
+          ok += tcp_client_failed(&relays[i]);
+        }
+        break;
+      case tcp_connecting:
+        if (POLL_READY(fds, slots[i].tcp)) {
+          finish_tcp_client(&relays[i]);
+          if (relays[i].tcp_state == tcp_connected &&
+              relays[i].out_len != 0) {
+            ok += flush_output(&relays[i]);
+          }
+        }
+        break;
+      case tcp_resolving:
+        /* Ask again; cheap if our lookup is still in flight. */
+        if (POLL_READY(fds, resolver_slot)) {
+          start_tcp_client(&relays[i]);
+        }
+        break;
+      case tcp_waiting:
+        if (now >= relays[i].retry_at) {
+          start_tcp_client(&relays[i]);
+        }
+        break;
       }
-      if (FD_ISSET(relays[i].udp_recv_sock, &readfds)) {
+      if (POLL_READY(fds, slots[i].udp)) {
         ok += udp_to_tcp(&relays[i]);
       }
+      if (POLL_READY(fds, slots[i].timer)) {
+        ok += output_timer_expired(&relays[i]);
+      }
+    }
+
+    if (POLL_READY(fds, devconn_slot)) {
+      ok += devconn_poll();
+    }
+    if (device_port != 0 && now != devices_expired_at) {
+      devconn_expire(device_idle);
+      devices_expired_at = now;
+    }
+
+    if (POLL_READY(fds, flow_slot)) {
+      ok += flow_poll();
+    }
+    if (flow_max != 0 && now != flows_expired_at) {
+      for (i = 0; i < relay_count; i++) {
+        if (relays[i].stripe == 0) {
+          flow_expire(relays[i].flows, now - flow_idle);
+        }
+      }
+      flows_expired_at = now;
+    }
+
+    if (POLL_READY(fds, handoff_slot) &&
+        serve_handoff(relays, relay_count, is_server)) {
+      exit(0);
     }
   } while (ok == 0);
 
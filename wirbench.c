@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wirbin.h"
+
+/* Check that wirbin records decode to what was encoded, then time
+ * formatting and parsing a record as a WIR line (as codec8_to_wir() and
+ * a WIR server do it) against wirbin_encode() and wirbin_decode().
+ * Run by "make check"; "wirbench N" times N records instead of the
+ * default.  Exits non-zero if a check fails. */
+
+#define BENCH_RECORDS 200000
+#define BENCH_NAME "3862BZB"
+
+static const struct wirbin_record samples[] = {
+  {350612075727717ULL, 1792337163728ULL, 404000000, -37000000, 0,
+   0, 77, 90, 2150, 2},
+  {350612075725976ULL, 1792337163728ULL, -338765432, -1512345678, 123456,
+   39, 0, 359, WIRBIN_NO_TEMPERATURE, 2},
+  {UINT64_MAX, UINT64_MAX, INT32_MIN, INT32_MAX, UINT32_MAX,
+   UINT16_MAX, UINT16_MAX, UINT16_MAX, INT16_MIN, UINT8_MAX},
+  {1, 0, -1, -1, 0, 0, 0, 0, -1, 0}
+};
+
+/*
+ * now_ns()
+ * Nanoseconds on the monotonic clock.
+ */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} /* now_ns */
+
+
+/*
+ * same_record()
+ * Return non-zero if a and b hold the same fields.
+ */
+static int same_record(const struct wirbin_record *a,
+                       const struct wirbin_record *b)
+{
+  return a->imei == b->imei && a->time_ms == b->time_ms &&
+         a->latitude == b->latitude && a->longitude == b->longitude &&
+         a->odometer == b->odometer && a->device == b->device &&
+         a->speed == b->speed && a->heading == b->heading &&
+         a->temperature == b->temperature && a->event == b->event;
+} /* same_record */
+
+
+/*
+ * check_round_trip()
+ * Encode and decode each sample, and try the decoder on truncated,
+ * malformed and longer (later version) records.  Return the number of
+ * failures.
+ */
+static int check_round_trip(void)
+{
+  unsigned char buf[WIRBIN_RECORD_LEN + 8];
+  struct wirbin_record r;
+  unsigned i;
+  int failed = 0, len;
+
+  for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+    len = wirbin_encode(buf, &samples[i]);
+    memset(&r, 0, sizeof(r));
+    if (len != WIRBIN_RECORD_LEN ||
+        wirbin_decode(buf, len, &r) != WIRBIN_RECORD_LEN ||
+        !same_record(&r, &samples[i])) {
+      fprintf(stderr, "sample %u: decoded record differs\n", i);
+      failed++;
+    }
+    if (wirbin_decode(buf, len - 1, &r) != 0 ||
+        wirbin_decode(buf, 1, &r) != 0) {
+      fprintf(stderr, "sample %u: truncated record not reported\n", i);
+      failed++;
+    }
+  }
+
+  /* A later version's record, with 8 more bytes, is decoded as far as we
+   * know it and skipped whole. */
+  wirbin_encode(buf, &samples[1]);
+  buf[1] += 8;
+  buf[2] = WIRBIN_VERSION + 1;
+  memset(buf + WIRBIN_RECORD_LEN, 0xff, 8);
+  if (wirbin_decode(buf, sizeof(buf), &r) != WIRBIN_RECORD_LEN + 8 ||
+      !same_record(&r, &samples[1])) {
+    fprintf(stderr, "longer record not decoded\n");
+    failed++;
+  }
+
+  buf[0] = 0;
+  buf[1] = WIRBIN_RECORD_LEN - 3;
+  if (wirbin_decode(buf, sizeof(buf), &r) != -1) {
+    fprintf(stderr, "short record not refused\n");
+    failed++;
+  }
+
+  return failed;
+} /* check_round_trip */
+
+
+/*
+ * format_wir()
+ * Write r as a WIR line to line, the way codec8_to_wir() does, and
+ * return its length.
+ */
+static int format_wir(char *line, const struct wirbin_record *r)
+{
+  time_t epch = r->time_ms / 1000;
+  struct tm tm;
+  float lat = r->latitude, lon = r->longitude, temp = r->temperature;
+
+  gmtime_r(&epch, &tm);
+  lat /= 10000000;
+  lon /= 10000000;
+  temp /= 100;
+  return sprintf(line, "%s,%02d%02d%02d%02d%02d%02d,%+09.5f,%+010.5f,%03d,%03d,%03d,%d,%+.0f|",
+                 BENCH_NAME, tm.tm_mday, tm.tm_mon + 1, tm.tm_year - 100,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, lat, lon, r->speed,
+                 r->heading, r->event, r->odometer, temp);
+} /* format_wir */
+
+
+/*
+ * parse_wir()
+ * Read the fields of a WIR line back, as a WIR server would.  Return the
+ * number of fields read.
+ */
+static int parse_wir(const char *line, struct wirbin_record *r)
+{
+  char name[16];
+  int day, mon, year, hour, min, sec, speed, heading, event;
+  unsigned odometer;
+  float lat, lon, temp;
+  int n;
+
+  n = sscanf(line, "%15[^,],%2d%2d%2d%2d%2d%2d,%f,%f,%d,%d,%d,%u,%f|",
+             name, &day, &mon, &year, &hour, &min, &sec, &lat, &lon,
+             &speed, &heading, &event, &odometer, &temp);
+  r->latitude = (int32_t)(lat * 10000000);
+  r->longitude = (int32_t)(lon * 10000000);
+  r->speed = speed;
+  r->heading = heading;
+  r->event = event;
+  r->odometer = odometer;
+  r->temperature = (int16_t)(temp * 100);
+  return n;
+} /* parse_wir */
+
+
+/*
+ * report()
+ * Print one line of results.
+ */
+static void report(const char *what, long bytes, long count, uint64_t ns)
+{
+  printf("%-14s %3ld bytes/record %8.1f ns/record\n", what, bytes / count,
+         (double) ns / count);
+} /* report */
+
+
+int main(int argc, char *argv[])
+{
+  static char line[256];
+  static unsigned char bin[WIRBIN_RECORD_LEN];
+  struct wirbin_record r = samples[0], out;
+  long count = BENCH_RECORDS, i, bytes;
+  volatile long sink = 0;
+  uint64_t start;
+  int failed;
+
+  if (argc > 1 && (count = strtol(argv[1], NULL, 0)) <= 0) {
+    fprintf(stderr, "Usage: %s [RECORDS]\n", argv[0]);
+    exit(2);
+  }
+
+  if ((failed = check_round_trip()) != 0) {
+    fprintf(stderr, "%d wirbin checks failed\n", failed);
+    exit(1);
+  }
+
+  /* Each record differs a little from the last, as a moving vehicle's
+   * do, so that nothing can be cached across iterations. */
+  bytes = 0;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    r.time_ms += 1000;
+    r.latitude += 17;
+    bytes += format_wir(line, &r);
+    sink += line[10];
+  }
+  report("WIR format", bytes, count, now_ns() - start);
+
+  bytes = 0;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    line[22] = '0' + i % 10;   /* a latitude digit */
+    if (parse_wir(line, &out) != 14) {
+      fprintf(stderr, "WIR line not parsed: %s\n", line);
+      exit(1);
+    }
+    bytes += strlen(line);
+    sink += out.latitude;
+  }
+  report("WIR parse", bytes, count, now_ns() - start);
+
+  r = samples[0];
+  bytes = 0;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    r.time_ms += 1000;
+    r.latitude += 17;
+    bytes += wirbin_encode(bin, &r);
+    sink += bin[25];
+  }
+  report("wirbin encode", bytes, count, now_ns() - start);
+
+  bytes = 0;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    bin[25] = i;
+    bytes += wirbin_decode(bin, sizeof(bin), &out);
+    sink += out.latitude;
+  }
+  report("wirbin decode", bytes, count, now_ns() - start);
+
+  return 0;
+} /* main */
@@ -0,0 +1,95 @@
+#include <stdint.h>
+
+#include "wirbin.h"
+
+static void put16(unsigned char *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+} /* put16 */
+
+static void put32(unsigned char *p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(p + 2, v);
+} /* put32 */
+
+static void put64(unsigned char *p, uint64_t v)
+{
+  put32(p, v >> 32);
+  put32(p + 4, v);
+} /* put64 */
+
+static uint16_t get16(const unsigned char *p)
+{
+  return (uint16_t)(p[0] << 8 | p[1]);
+} /* get16 */
+
+static uint32_t get32(const unsigned char *p)
+{
+  return (uint32_t)get16(p) << 16 | get16(p + 2);
+} /* get32 */
+
+static uint64_t get64(const unsigned char *p)
+{
+  return (uint64_t)get32(p) << 32 | get32(p + 4);
+} /* get64 */
+
+
+/*
+ * wirbin_encode()
+ * Write the record to out, which must have room for WIRBIN_RECORD_LEN
+ * bytes.  Return the number of bytes written.
+ */
+int wirbin_encode(unsigned char *out, const struct wirbin_record *r)
+{
+  put16(out, WIRBIN_RECORD_LEN - 2);
+  out[2] = WIRBIN_VERSION;
+  out[3] = r->event;
+  put16(out + 4, r->device);
+  put64(out + 6, r->imei);
+  put64(out + 14, r->time_ms);
+  put32(out + 22, (uint32_t) r->latitude);
+  put32(out + 26, (uint32_t) r->longitude);
+  put16(out + 30, r->speed);
+  put16(out + 32, r->heading);
+  put16(out + 34, (uint16_t) r->temperature);
+  put32(out + 36, r->odometer);
+  return WIRBIN_RECORD_LEN;
+} /* wirbin_encode */
+
+
+/*
+ * wirbin_decode()
+ * Decode the record at the start of the len bytes at in into *r.  Return
+ * the number of bytes it takes up, 0 if it is not all there yet, or -1
+ * if it is too short to be a record, after which the stream cannot be
+ * trusted.
+ */
+int wirbin_decode(const unsigned char *in, int len, struct wirbin_record *r)
+{
+  int size;
+
+  if (len < 2) {
+    return 0;
+  }
+  size = get16(in) + 2;
+  if (size < WIRBIN_RECORD_LEN) {
+    return -1;
+  }
+  if (len < size) {
+    return 0;
+  }
+
+  r->event = in[3];
+  r->device = get16(in + 4);
+  r->imei = get64(in + 6);
+  r->time_ms = get64(in + 14);
+  r->latitude = (int32_t) get32(in + 22);
+  r->longitude = (int32_t) get32(in + 26);
+  r->speed = get16(in + 30);
+  r->heading = get16(in + 32);
+  r->temperature = (int16_t) get16(in + 34);
+  r->odometer = get32(in + 36);
+  return size;
+} /* wirbin_decode */
@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+/* Compact binary records, an alternative to WIR lines for consumers of
+ * our own (--format=binary).  Each record is WIRBIN_RECORD_LEN bytes, all
+ * fields big-endian:
+ *
+ *    0  uint16  bytes following this field (WIRBIN_RECORD_LEN - 2)
+ *    2  uint8   WIRBIN_VERSION
+ *    3  uint8   event
+ *    4  uint16  device index in the name map
+ *    6  uint64  device IMEI
+ *   14  uint64  GPS time, milliseconds since the epoch
+ *   22  int32   latitude, 1e-7 degrees
+ *   26  int32   longitude, 1e-7 degrees
+ *   30  uint16  speed, km/h
+ *   32  uint16  heading, degrees
+ *   34  int16   temperature, 1/100 degree C, or WIRBIN_NO_TEMPERATURE
+ *   36  uint32  odometer
+ *
+ * Later versions will only append fields, so a reader can decode what it
+ * knows of a longer record and skip the rest by its length.
+ *
+ * wirbin.c depends on nothing else here, and is meant to be copied into
+ * consumers as the reference decoder.  "make check" runs wirbench, which
+ * checks it and times it against WIR lines. */
+
+#define WIRBIN_VERSION 1
+#define WIRBIN_RECORD_LEN 40
+#define WIRBIN_NO_TEMPERATURE (-9900)
+
+struct wirbin_record {
+  uint64_t imei;
+  uint64_t time_ms;
+  int32_t latitude, longitude;
+  uint32_t odometer;
+  uint16_t device, speed, heading;
+  int16_t temperature;
+  uint8_t event;
+};
+
+extern int wirbin_encode(unsigned char *out, const struct wirbin_record *r);
+extern int wirbin_decode(const unsigned char *in, int len,
+                         struct wirbin_record *r);
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include "zlink.h"
+#include "latency.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+
+#define ZLINK_CHUNK 65536     /* largest batch compressed in one go */
+
+struct zlink {
+  int level;                  /* ours, for output */
+  int peer_level;             /* the peer's, once its header is in */
+  z_stream out, in;
+  unsigned char header[ZLINK_HEADER_LEN];
+  int header_len;             /* bytes of the peer's header seen */
+  unsigned char *out_buf;
+  int out_size;
+
+  /* Counters, over all connections. */
+  uint64_t out_plain, out_packed, out_ns;
+  uint64_t in_plain, in_packed, in_ns;
+};
+
+/*
+ * zlink_new()
+ * Set up compression at the given level (0-9) for a relay's connections.
+ * Exit if anything goes wrong.
+ */
+struct zlink *zlink_new(int level)
+{
+  struct zlink *z;
+
+  if ((z = (struct zlink *) calloc(1, sizeof(*z))) == NULL) {
+    perror("zlink_new: calloc");
+    exit(1);
+  }
+  z->level = level;
+  if (deflateInit(&z->out, level) != Z_OK ||
+      inflateInit(&z->in) != Z_OK) {
+    fprintf(stderr, "zlink_new: cannot initialize zlib\n");
+    exit(1);
+  }
+
+  /* Room for a whole batch even if it does not compress at all. */
+  z->out_size = deflateBound(&z->out, ZLINK_CHUNK) + 16;
+  if ((z->out_buf = malloc(z->out_size)) == NULL) {
+    perror("zlink_new: malloc");
+    exit(1);
+  }
+  return z;
+} /* zlink_new */
+
+
+/*
+ * zlink_reset()
+ * A new connection: start fresh streams both ways, and fill in the header
+ * to send before anything else.
+ */
+void zlink_reset(struct zlink *z, unsigned char header[ZLINK_HEADER_LEN])
+{
+  deflateReset(&z->out);
+  inflateReset(&z->in);
+  z->header_len = 0;
+  z->peer_level = 0;
+  memcpy(header, ZLINK_MAGIC, ZLINK_HEADER_LEN - 1);
+  header[ZLINK_HEADER_LEN - 1] = z->level;
+} /* zlink_reset */
+
+
+/*
+ * zlink_deflate()
+ * Compress a batch of output, ending with a sync flush, and point *out at
+ * the result.  At level 0 the batch goes out as it is.  Return the length
+ * of the result, or -1 on failure.
+ */
+int zlink_deflate(struct zlink *z, const void *data, int len,
+                  unsigned char **out)
+{
+  uint64_t start;
+  int ret;
+
+  if (z->level == 0) {
+    *out = (unsigned char *) data;
+    return len;
+  }
+  if (len > ZLINK_CHUNK) {
+    return -1;
+  }
+
+  start = latency_now();
+  z->out.next_in = (Bytef *) data;
+  z->out.avail_in = len;
+  z->out.next_out = z->out_buf;
+  z->out.avail_out = z->out_size;
+  ret = deflate(&z->out, Z_SYNC_FLUSH);
+  if ((ret != Z_OK && ret != Z_BUF_ERROR) || z->out.avail_in != 0 ||
+      z->out.avail_out == 0) {
+    fprintf(stderr, "zlink_deflate: %s\n", z->out.msg ? z->out.msg : "failed");
+    return -1;
+  }
+
+  *out = z->out_buf;
+  z->out_plain += len;
+  z->out_packed += z->out_size - z->out.avail_out;
+  z->out_ns += latency_now() - start;
+  return z->out_size - z->out.avail_out;
+} /* zlink_deflate */
+
+
+/*
+ * zlink_inflate()
+ * Decode input from the peer: consume what we can of the *inlen bytes at
+ * *in, advancing both, and write at most room bytes of data to out.
+ * Return the number written, which is less than room only once the input
+ * is used up, or -1 if the input is not what we expect.
+ */
+int zlink_inflate(struct zlink *z, unsigned char **in, int *inlen,
+                  unsigned char *out, int room)
+{
+  uint64_t start;
+  int n, ret;
+
+  /* The peer's header comes first, possibly split across reads. */
+  while (z->header_len < ZLINK_HEADER_LEN && *inlen > 0) {
+    z->header[z->header_len++] = *(*in)++;
+    (*inlen)--;
+    if (z->header_len == ZLINK_HEADER_LEN) {
+      if (memcmp(z->header, ZLINK_MAGIC, ZLINK_HEADER_LEN - 1) != 0 ||
+          z->header[ZLINK_HEADER_LEN - 1] > 9) {
+        fprintf(stderr, "zlink_inflate: peer is not using --compress\n");
+        return -1;
+      }
+      z->peer_level = z->header[ZLINK_HEADER_LEN - 1];
+    }
+  }
+  if (z->header_len < ZLINK_HEADER_LEN) {
+    return 0;
+  }
+
+  if (z->peer_level == 0) {
+    n = *inlen < room ? *inlen : room;
+    memcpy(out, *in, n);
+    *in += n;
+    *inlen -= n;
+    return n;
+  }
+
+  start = latency_now();
+  z->in.next_in = *in;
+  z->in.avail_in = *inlen;
+  z->in.next_out = out;
+  z->in.avail_out = room;
+  ret = inflate(&z->in, Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_BUF_ERROR) {
+    fprintf(stderr, "zlink_inflate: %s\n",
+            ret == Z_STREAM_END ? "unexpected end of stream" :
+            z->in.msg ? z->in.msg : "failed");
+    return -1;
+  }
+
+  n = room - z->in.avail_out;
+  z->in_packed += *inlen - z->in.avail_in;
+  z->in_plain += n;
+  z->in_ns += latency_now() - start;
+  *in = z->in.next_in;
+  *inlen = z->in.avail_in;
+  return n;
+} /* zlink_inflate */
+
+
+/*
+ * zlink_stats()
+ * Print a relay's compression ratio and CPU cost each way.
+ */
+void zlink_stats(struct zlink *z, FILE *out, int relay)
+{
+  fprintf(out, "Relay %d: compressed %llu bytes to %llu (%.1f%%), "
+          "%.1f ns/byte; inflated %llu bytes from %llu (%.1f%%), "
+          "%.1f ns/byte\n", relay,
+          (unsigned long long) z->out_plain,
+          (unsigned long long) z->out_packed,
+          z->out_plain ? 100.0 * z->out_packed / z->out_plain : 0.0,
+          z->out_plain ? (double) z->out_ns / z->out_plain : 0.0,
+          (unsigned long long) z->in_plain,
+          (unsigned long long) z->in_packed,
+          z->in_plain ? 100.0 * z->in_packed / z->in_plain : 0.0,
+          z->in_plain ? (double) z->in_ns / z->in_plain : 0.0);
+} /* zlink_stats */
+
+#else /* !(HAVE_ZLIB_H && HAVE_LIBZ) */
+
+struct zlink *zlink_new(int level)
+{
+  fprintf(stderr, "Compression is not supported on this platform\n");
+  exit(2);
+} /* zlink_new */
+
+void zlink_reset(struct zlink *z, unsigned char header[ZLINK_HEADER_LEN]) { }
+int zlink_deflate(struct zlink *z, const void *data, int len,
+                  unsigned char **out) { return -1; }
+int zlink_inflate(struct zlink *z, unsigned char **in, int *inlen,
+                  unsigned char *out, int room) { return -1; }
+void zlink_stats(struct zlink *z, FILE *out, int relay) { }
+
+#endif /* HAVE_ZLIB_H && HAVE_LIBZ */
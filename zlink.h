@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/* Optional deflate compression of a TCP connection, each direction on its
+ * own.  Each side starts the connection by sending a 4-byte header,
+ * ZLINK_MAGIC and the compression level it will use (0: none), followed
+ * by a single zlib stream if the level is non-zero, or by the plain data.
+ * Every batch of output ends with a sync flush, so the peer can decode it
+ * at once.  Both sides must be run with --compress for the headers to be
+ * understood. */
+
+#define ZLINK_MAGIC "UTZ"
+#define ZLINK_HEADER_LEN 4
+
+struct zlink;
+
+extern struct zlink *zlink_new(int level);
+extern void zlink_reset(struct zlink *z, unsigned char header[ZLINK_HEADER_LEN]);
+extern int zlink_deflate(struct zlink *z, const void *data, int len,
+                         unsigned char **out);
+extern int zlink_inflate(struct zlink *z, unsigned char **in, int *inlen,
+                         unsigned char *out, int room);
+extern void zlink_stats(struct zlink *z, FILE *out, int relay);